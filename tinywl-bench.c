@@ -0,0 +1,420 @@
+/*
+ * Synthetic xdg-shell client used by `make bench`. It maps a number of
+ * toplevels backed by shm buffers, commits them at a fixed rate and
+ * periodically resizes, retitles and recreates them. Commit-to-present latency is
+ * measured as the time between a wl_surface.commit and the frame callback
+ * requested with it.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "xdg-shell-client-protocol.h"
+
+/* Latencies are kept in 100us buckets with the last one collecting the rest */
+#define LATENCY_BUCKETS 1000
+#define LATENCY_BUCKET_NS 100000
+
+struct bench_options {
+	int windows;
+	int rate;
+	int duration;
+	int resize_every;
+	int retitle_every;
+	int recreate_every;
+	int width, height;
+};
+
+struct bench_state {
+	struct bench_options options;
+	struct wl_display *display;
+	struct wl_compositor *compositor;
+	struct wl_shm *shm;
+	struct xdg_wm_base *wm_base;
+	struct wl_list windows;
+
+	uint64_t commits, resizes, retitles, recreates;
+	uint64_t latency_count, latency_total_ns, latency_max_ns;
+	uint32_t latency_histogram[LATENCY_BUCKETS];
+};
+
+struct bench_window {
+	struct wl_list link;
+	struct bench_state *state;
+	int index;
+	struct wl_surface *surface;
+	struct xdg_surface *xdg_surface;
+	struct xdg_toplevel *xdg_toplevel;
+	struct wl_buffer *buffer;
+	int width, height;
+	bool configured;
+	uint64_t commits;
+	struct wl_list frames; // bench_frame::link
+};
+
+/* One per commit so overlapping frame callbacks each get their own timestamp */
+struct bench_frame {
+	struct wl_list link;
+	struct bench_state *state;
+	struct wl_callback *callback;
+	struct timespec commit_time;
+};
+
+static uint64_t now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void latency_add(struct bench_state *state, uint64_t ns) {
+	uint64_t bucket = ns / LATENCY_BUCKET_NS;
+	if (bucket >= LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS - 1;
+	state->latency_histogram[bucket]++;
+	state->latency_count++;
+	state->latency_total_ns += ns;
+	if (ns > state->latency_max_ns)
+		state->latency_max_ns = ns;
+}
+
+static double latency_percentile_ms(struct bench_state *state,
+		double percentile) {
+	uint64_t target = state->latency_count * percentile / 100.0;
+	uint64_t seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += state->latency_histogram[i];
+		if (seen > target)
+			return (i + 1) * LATENCY_BUCKET_NS / 1e6;
+	}
+	return state->latency_max_ns / 1e6;
+}
+
+static struct wl_buffer *create_shm_buffer(struct bench_state *state,
+		int width, int height, uint32_t color) {
+	int stride = width * 4;
+	int size = stride * height;
+
+	int fd = memfd_create("tinywl-bench", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, size) < 0) {
+		fprintf(stderr, "Failed to allocate shm buffer: %s\n", strerror(errno));
+		exit(1);
+	}
+	uint32_t *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Failed to map shm buffer: %s\n", strerror(errno));
+		exit(1);
+	}
+	for (int i = 0; i < width * height; i++)
+		data[i] = color;
+	munmap(data, size);
+
+	struct wl_shm_pool *pool = wl_shm_create_pool(state->shm, fd, size);
+	struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0,
+		width, height, stride, WL_SHM_FORMAT_XRGB8888);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+	return buffer;
+}
+
+static void frame_handle_done(void *data, struct wl_callback *callback,
+		uint32_t time) {
+	struct bench_frame *frame = data;
+	uint64_t commit_ns = (uint64_t)frame->commit_time.tv_sec * 1000000000 +
+		frame->commit_time.tv_nsec;
+	latency_add(frame->state, now_ns() - commit_ns);
+	wl_callback_destroy(callback);
+	wl_list_remove(&frame->link);
+	free(frame);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_handle_done,
+};
+
+static void window_set_size(struct bench_window *window, int width, int height) {
+	if (window->buffer)
+		wl_buffer_destroy(window->buffer);
+	window->width = width;
+	window->height = height;
+	window->buffer = create_shm_buffer(window->state, width, height,
+		0xff203040 + window->index * 0x00010305);
+}
+
+static void window_commit(struct bench_window *window) {
+	struct bench_state *state = window->state;
+	struct bench_options *options = &state->options;
+
+	window->commits++;
+	if (options->resize_every && window->commits % options->resize_every == 0) {
+		bool grow = (window->commits / options->resize_every) % 2;
+		window_set_size(window, options->width + (grow ? 64 : 0),
+			options->height + (grow ? 48 : 0));
+		state->resizes++;
+	}
+	if (options->retitle_every && window->commits % options->retitle_every == 0) {
+		char title[64];
+		snprintf(title, sizeof(title), "bench %d - commit %lu",
+			window->index, (unsigned long)window->commits);
+		xdg_toplevel_set_title(window->xdg_toplevel, title);
+		state->retitles++;
+	}
+
+	struct bench_frame *frame = calloc(1, sizeof(struct bench_frame));
+	frame->state = state;
+	clock_gettime(CLOCK_MONOTONIC, &frame->commit_time);
+	frame->callback = wl_surface_frame(window->surface);
+	wl_callback_add_listener(frame->callback, &frame_listener, frame);
+	wl_list_insert(&window->frames, &frame->link);
+
+	wl_surface_attach(window->surface, window->buffer, 0, 0);
+	wl_surface_damage_buffer(window->surface, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_commit(window->surface);
+	state->commits++;
+}
+
+static void xdg_surface_handle_configure(void *data,
+		struct xdg_surface *xdg_surface, uint32_t serial) {
+	struct bench_window *window = data;
+	xdg_surface_ack_configure(xdg_surface, serial);
+	if (!window->configured) {
+		window->configured = true;
+		window_commit(window);
+	}
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+	.configure = xdg_surface_handle_configure,
+};
+
+static void xdg_toplevel_handle_configure(void *data,
+		struct xdg_toplevel *xdg_toplevel, int32_t width, int32_t height,
+		struct wl_array *states) {
+	/* The windows pick their own size, like a floating terminal would */
+}
+
+static void xdg_toplevel_handle_close(void *data,
+		struct xdg_toplevel *xdg_toplevel) {
+}
+
+static const struct xdg_toplevel_listener xdg_toplevel_listener = {
+	.configure = xdg_toplevel_handle_configure,
+	.close = xdg_toplevel_handle_close,
+};
+
+static void wm_base_handle_ping(void *data, struct xdg_wm_base *wm_base,
+		uint32_t serial) {
+	xdg_wm_base_pong(wm_base, serial);
+}
+
+static const struct xdg_wm_base_listener wm_base_listener = {
+	.ping = wm_base_handle_ping,
+};
+
+static void registry_handle_global(void *data, struct wl_registry *registry,
+		uint32_t name, const char *interface, uint32_t version) {
+	struct bench_state *state = data;
+	if (strcmp(interface, wl_compositor_interface.name) == 0) {
+		state->compositor = wl_registry_bind(registry, name,
+			&wl_compositor_interface, 4);
+	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
+		state->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	} else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
+		state->wm_base = wl_registry_bind(registry, name,
+			&xdg_wm_base_interface, 1);
+		xdg_wm_base_add_listener(state->wm_base, &wm_base_listener, state);
+	}
+}
+
+static void registry_handle_global_remove(void *data,
+		struct wl_registry *registry, uint32_t name) {
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = registry_handle_global,
+	.global_remove = registry_handle_global_remove,
+};
+
+static void window_map(struct bench_window *window) {
+	struct bench_state *state = window->state;
+	int index = window->index;
+	window->surface = wl_compositor_create_surface(state->compositor);
+	window->xdg_surface = xdg_wm_base_get_xdg_surface(state->wm_base,
+		window->surface);
+	xdg_surface_add_listener(window->xdg_surface, &xdg_surface_listener, window);
+	window->xdg_toplevel = xdg_surface_get_toplevel(window->xdg_surface);
+	xdg_toplevel_add_listener(window->xdg_toplevel, &xdg_toplevel_listener, window);
+
+	char title[32];
+	snprintf(title, sizeof(title), "bench %d", index);
+	xdg_toplevel_set_title(window->xdg_toplevel, title);
+	window_set_size(window, state->options.width, state->options.height);
+	wl_surface_commit(window->surface);
+}
+
+static void create_window(struct bench_state *state, int index) {
+	struct bench_window *window = calloc(1, sizeof(struct bench_window));
+	window->state = state;
+	window->index = index;
+	wl_list_init(&window->frames);
+	window_map(window);
+	wl_list_insert(&state->windows, &window->link);
+}
+
+/* Destroys the toplevel and creates a new one in its place, frames still
+ * waiting on the old surface are dropped without a latency sample. */
+static void window_recreate(struct bench_window *window) {
+	struct bench_frame *frame, *tmp;
+	wl_list_for_each_safe(frame, tmp, &window->frames, link) {
+		wl_callback_destroy(frame->callback);
+		wl_list_remove(&frame->link);
+		free(frame);
+	}
+	xdg_toplevel_destroy(window->xdg_toplevel);
+	xdg_surface_destroy(window->xdg_surface);
+	wl_surface_destroy(window->surface);
+	wl_buffer_destroy(window->buffer);
+	window->buffer = NULL;
+	window->configured = false;
+	window_map(window);
+	window->state->recreates++;
+}
+
+static void print_report(struct bench_state *state, double elapsed) {
+	struct bench_options *options = &state->options;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("tinywl-bench: %d windows at %d Hz for %.1f s\n",
+		options->windows, options->rate, elapsed);
+	printf("commits %lu (%.0f/s), resizes %lu, retitles %lu, recreates %lu\n",
+		(unsigned long)state->commits, state->commits / elapsed,
+		(unsigned long)state->resizes, (unsigned long)state->retitles,
+		(unsigned long)state->recreates);
+	if (state->latency_count) {
+		printf("commit-to-present latency: mean %.3f ms, p50 %.1f ms, "
+			"p99 %.1f ms, max %.3f ms\n",
+			state->latency_total_ns / 1e6 / state->latency_count,
+			latency_percentile_ms(state, 50),
+			latency_percentile_ms(state, 99),
+			state->latency_max_ns / 1e6);
+	}
+	printf("client peak RSS %ld KiB\n", usage.ru_maxrss);
+}
+
+int main(int argc, char *argv[]) {
+	struct bench_state state = {0};
+	state.options = (struct bench_options){
+		.windows = 16, .rate = 60, .duration = 10,
+		.resize_every = 30, .retitle_every = 60,
+		.width = 640, .height = 480,
+	};
+	wl_list_init(&state.windows);
+
+	int c;
+	while ((c = getopt(argc, argv, "n:r:d:R:T:C:h")) != -1) {
+		switch (c) {
+		case 'n':
+			state.options.windows = atoi(optarg);
+			break;
+		case 'r':
+			state.options.rate = atoi(optarg);
+			break;
+		case 'd':
+			state.options.duration = atoi(optarg);
+			break;
+		case 'R':
+			state.options.resize_every = atoi(optarg);
+			break;
+		case 'T':
+			state.options.retitle_every = atoi(optarg);
+			break;
+		case 'C':
+			state.options.recreate_every = atoi(optarg);
+			break;
+		default:
+			printf("Usage: %s [-n windows] [-r commit rate] [-d seconds] "
+				"[-R resize every n commits] [-T retitle every n commits] "
+				"[-C recreate every n commits]\n", argv[0]);
+			return 0;
+		}
+	}
+	if (state.options.rate <= 0)
+		state.options.rate = 1;
+
+	state.display = wl_display_connect(NULL);
+	if (!state.display) {
+		fprintf(stderr, "Failed to connect to the Wayland display\n");
+		return 1;
+	}
+	struct wl_registry *registry = wl_display_get_registry(state.display);
+	wl_registry_add_listener(registry, &registry_listener, &state);
+	wl_display_roundtrip(state.display);
+	if (!state.compositor || !state.shm || !state.wm_base) {
+		fprintf(stderr, "Compositor is missing required globals\n");
+		return 1;
+	}
+
+	for (int i = 0; i < state.options.windows; i++)
+		create_window(&state, i);
+	wl_display_roundtrip(state.display);
+
+	uint64_t interval = 1000000000 / state.options.rate;
+	uint64_t start = now_ns();
+	uint64_t end = start + (uint64_t)state.options.duration * 1000000000;
+	uint64_t next_tick = start + interval;
+	struct pollfd pfd = {
+		.fd = wl_display_get_fd(state.display),
+		.events = POLLIN,
+	};
+
+	while (now_ns() < end) {
+		uint64_t now = now_ns();
+		if (now >= next_tick) {
+			struct bench_window *window;
+			wl_list_for_each(window, &state.windows, link) {
+				if (!window->configured)
+					continue;
+				if (state.options.recreate_every && window->commits > 0 &&
+						window->commits % state.options.recreate_every == 0) {
+					window_recreate(window);
+				} else {
+					window_commit(window);
+				}
+			}
+			next_tick += interval;
+			if (next_tick < now)
+				next_tick = now + interval;
+		}
+
+		while (wl_display_prepare_read(state.display) != 0)
+			wl_display_dispatch_pending(state.display);
+		if (wl_display_flush(state.display) < 0 && errno != EAGAIN) {
+			wl_display_cancel_read(state.display);
+			break;
+		}
+
+		now = now_ns();
+		int timeout = next_tick > now ? (next_tick - now) / 1000000 : 0;
+		if (poll(&pfd, 1, timeout) > 0) {
+			if (wl_display_read_events(state.display) < 0)
+				break;
+		} else {
+			wl_display_cancel_read(state.display);
+		}
+		wl_display_dispatch_pending(state.display);
+	}
+
+	print_report(&state, (now_ns() - start) / 1e9);
+	wl_display_disconnect(state.display);
+	return 0;
+}
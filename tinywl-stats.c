@@ -0,0 +1,84 @@
+/*
+ * Reads the live metrics of a running tinywl from its stats socket. The
+ * compositor answers every connection with one report of "key field=value"
+ * lines ending with "end" and closes it, this prints the report as is.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* TINYWL_STATS_SOCKET is set for clients started by tinywl, otherwise the
+ * socket is found from the Wayland display name like the Wayland one is. */
+static int default_path(char *path, size_t size) {
+	const char *env = getenv("TINYWL_STATS_SOCKET");
+	if (env)
+		return snprintf(path, size, "%s", env);
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	const char *display = getenv("WAYLAND_DISPLAY");
+	if (!runtime_dir) {
+		fprintf(stderr, "XDG_RUNTIME_DIR is not set\n");
+		return -1;
+	}
+	return snprintf(path, size, "%s/%s.stats", runtime_dir,
+		display ? display : "wayland-0");
+}
+
+static int query(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	char buffer[4096];
+	ssize_t n;
+	while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+		fwrite(buffer, 1, n, stdout);
+	close(fd);
+	fflush(stdout);
+	return n < 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)] = {0};
+	int interval = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "S:i:h")) != -1) {
+		switch (c) {
+		case 'S':
+			snprintf(path, sizeof(path), "%s", optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		default:
+			printf("Usage: %s [-S stats socket] [-i interval seconds]\n", argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (!path[0] && default_path(path, sizeof(path)) < 0)
+		return 1;
+
+	/* With an interval the reports keep coming until the compositor exits,
+	 * each one is a full snapshot so they can be diffed as counters. */
+	int ret;
+	while ((ret = query(path)) == 0 && interval > 0) {
+		printf("\n");
+		sleep(interval);
+	}
+	return ret < 0 ? 1 : 0;
+}
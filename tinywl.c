@@ -1,33 +1,58 @@
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 #include <wayland-server-core.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <wlr/backend.h>
+#include <wlr/backend/headless.h>
+#include <wlr/interfaces/wlr_keyboard.h>
 #include <wlr/render/allocator.h>
+#include <wlr/render/pixman.h>
 #include <wlr/render/wlr_renderer.h>
 #include <wlr/types/wlr_cursor.h>
 #include <wlr/types/wlr_compositor.h>
 #include <wlr/types/wlr_data_device.h>
 #include <wlr/types/wlr_input_device.h>
 #include <wlr/types/wlr_keyboard.h>
+#include <wlr/types/wlr_keyboard_group.h>
 #include <wlr/types/wlr_output.h>
 #include <wlr/types/wlr_output_layout.h>
 #include <wlr/types/wlr_pointer.h>
+#include <wlr/types/wlr_presentation_time.h>
+#include <wlr/types/wlr_relative_pointer_v1.h>
 #include <wlr/types/wlr_scene.h>
 #include <wlr/types/wlr_seat.h>
 #include <wlr/types/wlr_server_decoration.h>
 #include <wlr/types/wlr_xcursor_manager.h>
 #include <wlr/types/wlr_xdg_decoration_v1.h>
 #include <wlr/types/wlr_xdg_shell.h>
+#include <wlr/util/addon.h>
 #include <wlr/util/log.h>
 #include <linux/input-event-codes.h>
 #include <xkbcommon/xkbcommon.h>
+#ifdef TINYWL_TEXT_FCFT
+#include <fcft/fcft.h>
+#else
 #include <pango/pangocairo.h>
+#endif
+#include <pixman.h>
 #include <drm_fourcc.h>
 
 /* For brevity's sake, struct members are annotated where they are used. */
@@ -38,6 +63,212 @@ enum tinywl_cursor_mode {
 	TINYWL_CURSOR_PRESSED,
 };
 
+#ifdef TINYWL_TEXT_FCFT
+/* Glyphs are rasterized once by fcft, which keeps them per font, and text is
+ * composed by compositing them with pixman. There is no shaping beyond the
+ * advance of each glyph, which is plenty for titles and menu labels. */
+#define TEXT_BACKEND_NAME "fcft"
+#define TEXT_FONT_SCALES 4
+
+/* The font loaded for one output scale */
+struct text_font {
+	float scale;
+	struct fcft_font *font;
+	const struct fcft_glyph *ascii[128]; // Owned by fcft, looked up once
+};
+
+struct tinywl_text_engine {
+	char name[256]; // fontconfig name of the font
+	struct text_font fonts[TEXT_FONT_SCALES]; // fonts[0] is at scale 1
+	int font_count;
+	pixman_image_t *foreground;
+	int line_height;
+};
+#else
+/* Long-lived Pango state used to measure and render all compositor text so
+ * that measuring a string only costs a layout update. */
+#define TEXT_BACKEND_NAME "pango"
+
+struct tinywl_text_engine {
+	PangoContext *context;
+	PangoFontDescription *font;
+	PangoLayout *measure_layout;
+	PangoLayout *render_layout;
+	int line_height;
+};
+#endif
+
+/* Input traces are a small header followed by fixed size records in host byte
+ * order, one for each event reaching the cursor and keyboard handlers. */
+#define TRACE_MAGIC "TWLTRC01"
+
+enum trace_event_type {
+	TRACE_MOTION,
+	TRACE_MOTION_ABSOLUTE,
+	TRACE_BUTTON,
+	TRACE_AXIS,
+	TRACE_FRAME,
+	TRACE_KEY,
+};
+
+struct trace_event {
+	uint32_t type;
+	uint32_t time_msec;
+	union {
+		struct { double dx, dy; } motion;
+		struct { double x, y; } motion_absolute;
+		struct { uint32_t button, state; } button;
+		struct {
+			double delta;
+			int32_t delta_discrete;
+			uint16_t orientation, source;
+		} axis;
+		struct { uint32_t keycode, state; } key;
+	};
+};
+
+struct input_replay {
+	struct trace_event *events;
+	size_t count, next;
+	struct wl_event_source *timer;
+};
+
+/* Spatial hash over the frames of mapped views used for hit-testing. The
+ * layout is split into square cells and every cell a view overlaps points
+ * at it from the bucket the cell hashes to. */
+#define SPATIAL_INDEX_CELL_SIZE 256
+#define SPATIAL_INDEX_BUCKETS 1024
+
+struct spatial_index {
+	struct wl_array buckets[SPATIAL_INDEX_BUCKETS]; // struct tinywl_view *
+};
+
+/* CPU time spent in a hot path, only sampled while profiling */
+struct profile_counter {
+	uint64_t calls;
+	uint64_t total_ns, max_ns;
+};
+
+/* Fixed size objects are carved out of slabs and recycled through a free
+ * list, so creating and destroying views and their node details reuses the
+ * same memory instead of going through malloc for each of them. */
+#define SLAB_OBJECTS 64
+
+struct slab {
+	struct wl_list link;
+	_Alignas(max_align_t) unsigned char objects[];
+};
+
+struct slab_pool {
+	const char *name;
+	size_t object_size;
+	struct wl_list slabs; // slab::link
+	void *free_list; // Linked through the first word of each free object
+	uint64_t allocs, frees;
+	size_t in_use, peak, slab_count;
+};
+
+enum keybinding_action {
+	ACTION_EXIT,
+	ACTION_CYCLE,
+	ACTION_MAXIMIZE,
+	ACTION_CLOSE,
+	ACTION_SPAWN,
+	ACTION_MOVE_TO_EDGE,
+};
+
+struct keybinding {
+	uint32_t modifiers; // WLR_MODIFIER_* mask, 0 for an empty slot
+	xkb_keysym_t sym; // Lower case, XKB_KEY_NoSymbol for an empty slot
+	enum keybinding_action action;
+	enum wlr_edges edge; // ACTION_MOVE_TO_EDGE
+	char *command; // ACTION_SPAWN
+};
+
+/* Open addressing on (modifiers, keysym), with at least twice as many slots
+ * as bindings so a key press is one hash and a probe or two. */
+struct keybinding_table {
+	struct keybinding *slots;
+	size_t size; // Power of two
+	size_t count;
+};
+
+/* Spans of the main handlers, recorded with -t and written out as Chrome trace
+ * JSON, which Perfetto loads, on SIGUSR1 and at exit. Writers claim a slot
+ * with an atomic increment and publish it through its sequence number so the
+ * ring needs no lock, it keeps the most recent SPAN_RING_SIZE spans. */
+#define SPAN_RING_SIZE (1 << 16)
+
+struct span {
+	_Atomic uint64_t seq; // Claimed index + 1 once written, 0 while writing
+	const char *name;
+	uint64_t start_ns, duration_ns;
+	uint32_t thread_id;
+};
+
+struct span_ring {
+	const char *path;
+	_Atomic uint64_t head;
+	struct span spans[SPAN_RING_SIZE];
+};
+
+/* Benchmark mode samples the RSS every second so growth over a long run
+ * shows up, the peak alone can't tell a leak from a large working set. */
+struct rss_samples {
+	struct wl_event_source *timer;
+	long first_kb, last_kb, max_kb;
+	int count;
+};
+
+/* Unix socket next to the Wayland one that answers every connection with a
+ * snapshot of the live metrics as "key field=value" lines and closes it, see
+ * tinywl-stats. The report is built up front and written as the socket
+ * drains so a reader that stalls can't block the compositor. */
+struct stats_connection {
+	struct wl_list link; // stats_socket::connections
+	int fd;
+	struct wl_event_source *source;
+	char *data;
+	size_t size, written;
+};
+
+struct stats_socket {
+	int fd;
+	char *path;
+	struct wl_event_source *source;
+	struct wl_list connections;
+};
+
+/* Titles are rasterized off the event loop by a few workers, each with a text
+ * engine of its own as Pango contexts can't be shared between threads. Jobs
+ * go through queue and come back through done, whose list is signalled with
+ * event_fd. Everything else about a job is only touched by the main thread
+ * or by the one worker rendering it. */
+struct title_job {
+	struct wl_list link; // title_workers::queue or title_workers::done
+	struct tinywl_view *view; // NULL once superseded or the view is gone
+	bool started; // Guarded by the lock
+	char *text;
+	int width, height;
+	float scale;
+	struct text_buffer *buffers[2]; // Rendered inactive and active variant
+};
+
+struct title_workers {
+	struct tinywl_server *server;
+	pthread_t *threads;
+	int count; // 0 renders titles synchronously
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct wl_list queue; // title_job::link
+	struct wl_list done; // title_job::link
+	bool stopping;
+	struct profile_counter profile_render; // CPU time of the workers
+	int event_fd;
+	struct wl_event_source *source;
+	uint64_t submitted, coalesced, superseded;
+};
+
 struct tinywl_server {
 	struct wl_display *wl_display;
 	struct wlr_backend *backend;
@@ -51,29 +282,128 @@ struct tinywl_server {
 
 	struct wlr_cursor *cursor;
 	struct wlr_xcursor_manager *cursor_mgr;
+	/* What the cursor shows, either an xcursor name or a client surface. It is
+	 * only changed through cursor_set_xcursor and cursor_set_surface so that
+	 * setting the image it already has is skipped. */
+	const char *cursor_image;
+	bool cursor_surface_set;
+	struct wlr_surface *cursor_surface;
+	int32_t cursor_hotspot_x, cursor_hotspot_y;
+	struct wl_listener cursor_surface_destroy;
+	uint64_t cursor_image_skipped;
 	struct wl_listener cursor_motion;
 	struct wl_listener cursor_motion_absolute;
 	struct wl_listener cursor_button;
 	struct wl_listener cursor_axis;
 	struct wl_listener cursor_frame;
+	struct wlr_relative_pointer_manager_v1 *relative_pointer_manager;
+	bool motion_pending;
+	uint32_t motion_pending_time;
 
 	struct wlr_seat *seat;
 	struct wl_listener new_input;
 	struct wl_listener request_cursor;
 	struct wl_listener request_set_selection;
-	struct wl_list keyboards;
+	struct xkb_context *xkb_context;
+	struct keybinding_table keybindings;
+	struct rss_samples rss_samples;
+	struct span_ring *spans; // NULL unless tracing
+	struct stats_socket stats;
+	struct slab_pool view_pool; // tinywl_view
+	struct slab_pool node_pool; // tinywl_node_details
+	struct wl_list keyboards; // One tinywl_keyboard per distinct keymap
 	enum tinywl_cursor_mode cursor_mode;
 	struct tinywl_view *grabbed_view;
 	double grab_x, grab_y;
 	struct wlr_box grab_geobox;
 	uint32_t resize_edges;
 	struct wlr_scene_tree *view_menu;
+	float view_menu_scale;
 	struct tinywl_view *opened_menu_view;
 	struct wlr_scene_rect *selected_menu_item;
+	struct spatial_index view_index;
+	uint64_t hit_tests, hit_test_scene_walks;
+	uint64_t stack_serial;
+	int popup_count;
 
 	struct wlr_output_layout *output_layout;
 	struct wl_list outputs;
 	struct wl_listener new_output;
+	struct wlr_presentation *presentation;
+	struct wl_list present_pending; // tinywl_view::present_link
+	struct wl_list decorations_dirty; // tinywl_view::decoration_link
+	bool visibility_dirty;
+	/* Off in benchmark mode, tinywl-bench can't place its windows and they
+	 * all pile up centred, so most of them would be throttled. */
+	bool throttle_occluded;
+
+	struct tinywl_text_engine text_engine;
+	struct title_workers title_workers;
+	struct wl_list title_cache;
+	int title_cache_length;
+
+	pid_t startup_pid; // The benchmark driver in -b mode
+
+	FILE *trace_record;
+	uint32_t trace_pointer_time_msec;
+	struct input_replay replay;
+	bool profiling;
+	struct profile_counter profile_cursor_motion;
+	struct profile_counter profile_view_at;
+	struct profile_counter profile_cursor_image;
+	struct profile_counter profile_commit;
+	struct profile_counter profile_decorations;
+	struct profile_counter profile_text_measure;
+	struct profile_counter profile_text_render;
+	int64_t text_engine_init_ns;
+};
+
+/* Render times of output_frame, kept in 100us buckets with the last bucket
+ * collecting everything slower. */
+#define FRAME_HISTOGRAM_BUCKETS 200
+#define FRAME_HISTOGRAM_BUCKET_NS 100000
+
+struct frame_stats {
+	uint64_t frames;
+	uint64_t total_ns, max_ns;
+	uint32_t histogram[FRAME_HISTOGRAM_BUCKETS];
+};
+
+/* Like sway's max_render_time, rendering is delayed from the frame event to
+ * just before the next vblank so that input arriving meanwhile still makes it
+ * into the frame. */
+#define RENDER_SAFETY_MARGIN_NS 1000000
+
+struct frame_schedule {
+	struct wl_event_source *timer;
+	struct timespec last_present;
+	int64_t refresh_ns;
+	int64_t render_estimate_ns; // Decaying max of recent render times
+	struct timespec deadline; // Predicted vblank of the scheduled frame
+	bool has_deadline;
+	int delay_ms; // Delay chosen for the last frame
+	uint64_t delayed_frames, missed_deadlines;
+};
+
+/* Outcome of a frame on an output with a fullscreen view. Everything but
+ * SCANOUT_DIRECT is a reason the scene had to composite instead. */
+enum scanout_status {
+	SCANOUT_DIRECT, // The client buffer was handed to the output as is
+	SCANOUT_REJECTED, // The output test failed, e.g. format or cursor plane
+	SCANOUT_NO_BUFFER,
+	SCANOUT_OTHER_SURFACES, // Dialogs, popups, subsurfaces or the menu
+	SCANOUT_GEOMETRY, // The buffer doesn't exactly cover the output
+	SCANOUT_SCALE_TRANSFORM,
+	SCANOUT_STATUS_COUNT,
+};
+
+static const char *scanout_status_names[SCANOUT_STATUS_COUNT] = {
+	[SCANOUT_DIRECT] = "direct",
+	[SCANOUT_REJECTED] = "rejected by output",
+	[SCANOUT_NO_BUFFER] = "no buffer",
+	[SCANOUT_OTHER_SURFACES] = "other surfaces",
+	[SCANOUT_GEOMETRY] = "geometry",
+	[SCANOUT_SCALE_TRANSFORM] = "scale or transform",
 };
 
 struct tinywl_output {
@@ -81,18 +411,63 @@ struct tinywl_output {
 	struct tinywl_server *server;
 	struct wlr_output *wlr_output;
 	struct wl_listener frame;
+	struct wl_listener present;
+	struct wl_listener commit;
+	struct wl_listener destroy;
 	struct wlr_scene_rect *background;
+	struct frame_stats frame_stats;
+	struct frame_schedule schedule;
+	struct tinywl_view *fullscreen_view;
+	/* Set around the scene commit of a fullscreen frame, the commit event then
+	 * tells whether the candidate buffer really was scanned out. */
+	bool scanout_pending;
+	enum scanout_status scanout_expected;
+	struct wlr_buffer *scanout_candidate;
+	uint64_t scanout[SCANOUT_STATUS_COUNT];
 };
 
 struct previous_geo {
 	int x, y, width, height;
 };
 
+/* Titles are drawn onto the titlebar colour into opaque buffers, so the
+ * renderer copies them instead of blending. There is one buffer per focus
+ * state and only the one matching the view is enabled. */
 struct title {
-	struct wlr_scene_buffer *buffer;
+	struct wlr_scene_buffer *buffers[2]; // Indexed by active
+	bool active;
+	float scale; // Output scale the title was last rendered for
+	char *text;
+	size_t text_size; // Allocated size of text, only ever grows
 	int original_width, current_width;
 };
 
+/* An interactive resize only has one configure in flight at a time, the
+ * latest size asked for meanwhile is queued. The view is moved when the
+ * client commits the acked size, or when it takes too long to do so. A
+ * configure that timed out is still placed when the client gets to it. */
+struct resize_transaction {
+	uint32_t serial; // Configure being waited on, 0 when idle
+	struct wlr_box box; // Layout box the configure was sent for
+	uint32_t edges;
+	bool queued;
+	struct wlr_box queued_box;
+	uint32_t queued_edges;
+	uint32_t late_serial; // Configure that timed out, 0 when none
+	struct wlr_box late_box;
+	uint32_t late_edges;
+	struct wl_event_source *timeout;
+};
+
+/* What the decorations were last laid out for. Commits that leave all of it
+ * as is, which is most of them for clients that redraw every frame, don't
+ * touch the decorations at all. */
+struct decoration_state {
+	struct wlr_box geometry; // Window geometry of the xdg surface
+	int surface_width, surface_height;
+	struct wlr_box extents; // Surface with its subsurfaces, see view_index_update
+};
+
 struct tinywl_view {
 	struct wl_list link;
 	struct tinywl_server *server;
@@ -102,6 +477,7 @@ struct tinywl_view {
 	struct wlr_scene_rect *titlebar;
 	struct wlr_scene_rect *close_button;
 	struct title title;
+	struct title_job *title_job; // Queued or rendering, NULL if up to date
 	struct wl_listener map;
 	struct wl_listener unmap;
 	struct wl_listener destroy;
@@ -109,15 +485,48 @@ struct tinywl_view {
 	struct wl_listener request_move;
 	struct wl_listener request_resize;
 	struct wl_listener request_maximize;
+	struct wl_listener request_fullscreen;
 	struct wl_listener set_title;
+	struct wl_list owned_nodes; // tinywl_node_details::link
+	struct decoration_state decoration_state;
+	struct wl_list decoration_link; // tinywl_server::decorations_dirty
+	bool decoration_dirty;
 	struct previous_geo saved_geometry;
 	int x, y;
+	struct tinywl_output *fullscreen_output;
+	struct wlr_box fullscreen_saved; // Position and size to go back to
+	struct wlr_addon surface_addon;
+	struct wlr_box index_box; // Layout coordinates of the frame in view_index
+	bool indexed;
+	uint64_t stack_serial; // Higher is closer to the top
+	int child_count; // Mapped dialogs whose scene node is under this view
+	struct resize_transaction resize;
+	/* Committed content not yet sampled into an output frame. If the client
+	 * commits again before that, the previous content was discarded. */
+	struct wl_list present_link;
+	bool present_pending;
+	uint64_t commits, frames_presented, frames_discarded;
+	/* Views completely covered by the opaque frames of views above them only
+	 * get frame callbacks every CONFIG.occluded_frame_interval_ms. */
+	struct wlr_box opaque_box;
+	bool occluded;
+	struct timespec last_frame_done;
+	uint64_t frames_throttled;
+};
+
+struct tinywl_popup {
+	struct tinywl_server *server;
+	struct wl_listener destroy;
 };
 
+/* Keyboards with the same RMLVO names share one compiled keymap and are put
+ * in a keyboard group. The seat only sees the group, so clients are sent one
+ * keymap fd instead of a new one whenever another device is typed on. */
 struct tinywl_keyboard {
 	struct wl_list link;
 	struct tinywl_server *server;
-	struct wlr_input_device *device;
+	struct wlr_keyboard_group *group;
+	struct xkb_rule_names names; // Owned copies, NULL for the default
 
 	struct wl_listener modifiers;
 	struct wl_listener key;
@@ -136,6 +545,8 @@ struct tinywl_node_details {
 	void *owner;
 	struct tinywl_view *view;
 	int index;
+	struct tinywl_server *server;
+	struct wl_list link; // tinywl_view::owned_nodes
 	struct wl_listener destroy;
 };
 
@@ -150,19 +561,176 @@ typedef struct Global_config {
 	const float background_rgba[4];
 	const float active_window_rgba[4];
 	const float inactive_window_rgba[4];
+	const int title_cache_size;
+	const bool coalesce_motion;
+	const int resize_timeout_ms;
+	const int max_render_time_ms; // 0 renders right away, -1 measures it
+	const int occluded_frame_interval_ms;
+	const int title_workers; // 0 renders titles on the event loop
+	const float output_scale; // 0 picks 1 or 2 from the output's DPI
 }Global_config;
 const Global_config CONFIG = {
 		"Sans 12", 2, 2, 3, 500, 16,
 		{ 0.2f, 0.2f, 0.25f, 1.0f },
 		{ 0.0f, 0.47f, 0.8f, 1.0f },
-		{ 0.33f, 0.33f, 0.33f, 1.0f }
+		{ 0.33f, 0.33f, 0.33f, 1.0f },
+		64, true, 150, -1, 1000, 2, 1
 };
 int TITLEBAR_HEIGHT;
 
+static void slab_pool_init(struct slab_pool *pool, const char *name,
+		size_t object_size) {
+	*pool = (struct slab_pool){ .name = name };
+	// Every object has to fit the free list link and keep the slab alignment
+	if (object_size < sizeof(void *))
+		object_size = sizeof(void *);
+	pool->object_size = (object_size + _Alignof(max_align_t) - 1) &
+		~(_Alignof(max_align_t) - 1);
+	wl_list_init(&pool->slabs);
+}
+
+static void *slab_alloc(struct slab_pool *pool) {
+	if (!pool->free_list) {
+		struct slab *slab = malloc(sizeof(struct slab) +
+			pool->object_size * SLAB_OBJECTS);
+		if (!slab)
+			return NULL;
+		wl_list_insert(&pool->slabs, &slab->link);
+		pool->slab_count++;
+		for (int i = SLAB_OBJECTS - 1; i >= 0; i--) {
+			void **object = (void **)(slab->objects + pool->object_size * i);
+			*object = pool->free_list;
+			pool->free_list = object;
+		}
+	}
+	void **object = pool->free_list;
+	pool->free_list = *object;
+	memset(object, 0, pool->object_size);
+	pool->allocs++;
+	if (++pool->in_use > pool->peak)
+		pool->peak = pool->in_use;
+	return object;
+}
+
+static void slab_free(struct slab_pool *pool, void *object) {
+	if (!object)
+		return;
+	*(void **)object = pool->free_list;
+	pool->free_list = object;
+	pool->frees++;
+	pool->in_use--;
+}
+
+static void slab_pool_finish(struct slab_pool *pool) {
+	struct slab *slab, *tmp;
+	wl_list_for_each_safe(slab, tmp, &pool->slabs, link) {
+		wl_list_remove(&slab->link);
+		free(slab);
+	}
+	pool->free_list = NULL;
+	pool->slab_count = 0;
+}
+
+static void print_slab_pool(struct slab_pool *pool) {
+	printf("%s pool: %zu in use, peak %zu, %zu slabs of %d, "
+		"%lu allocs, %lu frees\n", pool->name, pool->in_use, pool->peak,
+		pool->slab_count, SLAB_OBJECTS, (unsigned long)pool->allocs,
+		(unsigned long)pool->frees);
+}
+
+static uint64_t profile_begin(struct tinywl_server *server) {
+	if (!server->profiling)
+		return 0;
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void profile_end(struct tinywl_server *server,
+		struct profile_counter *counter, uint64_t start) {
+	if (!server->profiling)
+		return;
+	uint64_t ns = profile_begin(server) - start;
+	counter->calls++;
+	counter->total_ns += ns;
+	if (ns > counter->max_ns)
+		counter->max_ns = ns;
+}
+
+static uint64_t span_begin(struct tinywl_server *server) {
+	if (!server->spans)
+		return 0;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint32_t span_thread_id(void) {
+	static atomic_uint next_thread_id = 1;
+	static _Thread_local uint32_t thread_id;
+	if (!thread_id)
+		thread_id = atomic_fetch_add(&next_thread_id, 1);
+	return thread_id;
+}
+
+static void span_end(struct tinywl_server *server, const char *name,
+		uint64_t start) {
+	struct span_ring *ring = server->spans;
+	if (!ring)
+		return;
+	uint64_t end = span_begin(server);
+	uint64_t index = atomic_fetch_add_explicit(&ring->head, 1,
+		memory_order_relaxed);
+	struct span *span = &ring->spans[index & (SPAN_RING_SIZE - 1)];
+	atomic_store_explicit(&span->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	span->name = name;
+	span->start_ns = start;
+	span->duration_ns = end - start;
+	span->thread_id = span_thread_id();
+	atomic_store_explicit(&span->seq, index + 1, memory_order_release);
+}
+
+static void spans_dump(struct span_ring *ring) {
+	FILE *file = fopen(ring->path, "w");
+	if (!file) {
+		wlr_log(WLR_ERROR, "Failed to open %s to write the trace", ring->path);
+		return;
+	}
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+		"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":1,"
+		"\"args\":{\"name\":\"tinywl\"}}", (int)getpid());
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t index = head > SPAN_RING_SIZE ? head - SPAN_RING_SIZE : 0;
+	for (; index < head; index++) {
+		struct span *slot = &ring->spans[index & (SPAN_RING_SIZE - 1)];
+		uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		struct span span = {
+			.name = slot->name, .start_ns = slot->start_ns,
+			.duration_ns = slot->duration_ns, .thread_id = slot->thread_id,
+		};
+		atomic_thread_fence(memory_order_acquire);
+		// Skip slots being written or already reused meanwhile
+		if (seq != index + 1 ||
+				atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+			continue;
+		fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+			"\"dur\":%.3f,\"pid\":%d,\"tid\":%u}", span.name,
+			span.start_ns / 1e3, span.duration_ns / 1e3, (int)getpid(),
+			span.thread_id);
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+	wlr_log(WLR_INFO, "Wrote %lu spans to %s", (unsigned long)(head < SPAN_RING_SIZE ?
+		head : SPAN_RING_SIZE), ring->path);
+}
+
 // Inspired from sway/labwc node.c/h
 static void node_destroy(struct tinywl_node_details *tinywl_node_details) {
 	wl_list_remove(&tinywl_node_details->destroy.link);
-	free(tinywl_node_details);
+	wl_list_remove(&tinywl_node_details->link);
+	slab_free(&tinywl_node_details->server->node_pool, tinywl_node_details);
 }
 
 static void node_destroy_notify(struct wl_listener *listener, void *data) {
@@ -171,37 +739,424 @@ static void node_destroy_notify(struct wl_listener *listener, void *data) {
 	node_destroy(tinywl_node_details);
 }
 
-struct tinywl_node_details *node_init(enum tinywl_node_type type,
-		void *owner, struct tinywl_view *view, int index) {
+/* Attaches the details to the node, they live as long as it does. Nodes of a
+ * view are also owned by it, see view_release. */
+static void node_init(struct tinywl_server *server, struct wlr_scene_node *node,
+		enum tinywl_node_type type, void *owner, struct tinywl_view *view, int index) {
 	struct tinywl_node_details *tinywl_node_details =
-		calloc(1, sizeof(struct tinywl_node_details));
+		slab_alloc(&server->node_pool);
 	tinywl_node_details->type = type;
 	tinywl_node_details->owner = owner;
 	tinywl_node_details->view = view;
 	tinywl_node_details->index = index;
+	tinywl_node_details->server = server;
 
-	tinywl_node_details->destroy.notify = node_destroy_notify;
 	if (view){
-		wl_signal_add(&view->xdg_surface->events.destroy, &tinywl_node_details->destroy);
-	} // For nodes that don't have a view (menu) this should be attached to something else
+		wl_list_insert(&view->owned_nodes, &tinywl_node_details->link);
+	} else {
+		wl_list_init(&tinywl_node_details->link);
+	}
+	tinywl_node_details->destroy.notify = node_destroy_notify;
+	wl_signal_add(&node->events.destroy, &tinywl_node_details->destroy);
+	node->data = tinywl_node_details;
+}
 
-	return tinywl_node_details;
+static void node_move(struct tinywl_node_details *tinywl_node_details,
+		struct wlr_scene_node *node) {
+	wl_list_remove(&tinywl_node_details->destroy.link);
+	wl_signal_add(&node->events.destroy, &tinywl_node_details->destroy);
+	node->data = tinywl_node_details;
+}
+
+/* Mapped views are attached to their wlr_surface as an addon so that finding
+ * the view of a surface doesn't need to search server->views. */
+static void view_surface_addon_destroy(struct wlr_addon *addon) {
+	wlr_addon_finish(addon);
 }
 
-// From hopalong, is there a better way?
+static const struct wlr_addon_interface view_surface_addon_impl = {
+	.name = "tinywl_view",
+	.destroy = view_surface_addon_destroy,
+};
+
 static struct tinywl_view *tinywl_view_from_wlr_surface(
 		struct tinywl_server *server, struct wlr_surface *surface) {
-	struct tinywl_view *view;
+	if (!surface)
+		return NULL;
+	struct wlr_addon *addon = wlr_addon_find(&surface->addons, server,
+		&view_surface_addon_impl);
+	if (!addon)
+		return NULL;
+	struct tinywl_view *view = wl_container_of(addon, view, surface_addon);
+	return view;
+}
+
+static int spatial_index_cell(int coord) {
+	// Round towards negative infinity so cells left/above the origin work
+	return coord >= 0 ? coord / SPATIAL_INDEX_CELL_SIZE :
+		-((-coord - 1) / SPATIAL_INDEX_CELL_SIZE) - 1;
+}
+
+static struct wl_array *spatial_index_bucket(struct spatial_index *index,
+		int cell_x, int cell_y) {
+	uint32_t hash = ((uint32_t)cell_x * 73856093u) ^ ((uint32_t)cell_y * 19349663u);
+	return &index->buckets[hash % SPATIAL_INDEX_BUCKETS];
+}
 
-	wl_list_for_each(view, &server->views, link)
-	{
-		if (surface == view->xdg_surface->surface)
-			return view;
+static void spatial_index_remove(struct spatial_index *index,
+		struct tinywl_view *view) {
+	struct wlr_box *box = &view->index_box;
+	for (int cy = spatial_index_cell(box->y);
+			cy <= spatial_index_cell(box->y + box->height - 1); cy++) {
+		for (int cx = spatial_index_cell(box->x);
+				cx <= spatial_index_cell(box->x + box->width - 1); cx++) {
+			struct wl_array *bucket = spatial_index_bucket(index, cx, cy);
+			struct tinywl_view **views = bucket->data;
+			size_t count = bucket->size / sizeof(*views);
+			for (size_t i = 0; i < count; i++) {
+				if (views[i] == view) {
+					// Order doesn't matter, move the last one into the hole
+					views[i] = views[count - 1];
+					bucket->size -= sizeof(*views);
+					break;
+				}
+			}
+		}
 	}
+	view->indexed = false;
+}
+
+static void spatial_index_insert(struct spatial_index *index,
+		struct tinywl_view *view) {
+	struct wlr_box *box = &view->index_box;
+	for (int cy = spatial_index_cell(box->y);
+			cy <= spatial_index_cell(box->y + box->height - 1); cy++) {
+		for (int cx = spatial_index_cell(box->x);
+				cx <= spatial_index_cell(box->x + box->width - 1); cx++) {
+			struct wl_array *bucket = spatial_index_bucket(index, cx, cy);
+			// Different cells of a large view can hash to the same bucket
+			bool found = false;
+			struct tinywl_view **entry;
+			wl_array_for_each(entry, bucket) {
+				if (*entry == view) {
+					found = true;
+					break;
+				}
+			}
+			if (!found) {
+				entry = wl_array_add(bucket, sizeof(*entry));
+				*entry = view;
+			}
+		}
+	}
+	view->indexed = true;
+}
+
+static void spatial_index_finish(struct spatial_index *index) {
+	for (int i = 0; i < SPATIAL_INDEX_BUCKETS; i++) {
+		wl_array_release(&index->buckets[i]);
+	}
+}
+
+static struct tinywl_view *view_parent(struct tinywl_view *view) {
+	struct wlr_xdg_surface *parent = view->xdg_surface->toplevel->parent;
+	return parent ? tinywl_view_from_wlr_surface(view->server, parent->surface) : NULL;
+}
+
+/* Dialogs live in the scene tree of their parent, so they are stacked by the
+ * position of their topmost ancestor first, then by depth. */
+static bool view_is_above(struct tinywl_view *a, struct tinywl_view *b) {
+	struct tinywl_view *root_a = a, *root_b = b, *parent;
+	int depth_a = 0, depth_b = 0;
+	while ((parent = view_parent(root_a))) {
+		root_a = parent;
+		depth_a++;
+	}
+	while ((parent = view_parent(root_b))) {
+		root_b = parent;
+		depth_b++;
+	}
+	if (root_a != root_b)
+		return root_a->stack_serial > root_b->stack_serial;
+	if (depth_a != depth_b)
+		return depth_a > depth_b;
+	return a->stack_serial > b->stack_serial;
+}
+
+static void view_queue_decorations(struct tinywl_view *view) {
+	if (!view->decoration_dirty) {
+		view->decoration_dirty = true;
+		wl_list_insert(&view->server->decorations_dirty, &view->decoration_link);
+	}
+}
+
+/* Outside of a commit there is no surface damage to get a frame rendered,
+ * the outputs showing the view are asked for one. */
+static void view_schedule_decorations(struct tinywl_view *view) {
+	view_queue_decorations(view);
+	struct tinywl_server *server = view->server;
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		struct wlr_box *box = wlr_output_layout_get_box(
+			server->output_layout, output->wlr_output);
+		struct wlr_box intersection;
+		if (box && wlr_box_intersection(&intersection, box, &view->index_box))
+			wlr_output_schedule_frame(output->wlr_output);
+	}
+}
 
+/* Titles are rendered for the highest scale among the outputs the view is
+ * on, or among all outputs while it isn't on any yet. */
+static float view_title_scale(struct tinywl_view *view) {
+	struct tinywl_server *server = view->server;
+	float scale = 0.0f, highest = 1.0f;
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		float output_scale = output->wlr_output->scale;
+		if (output_scale > highest)
+			highest = output_scale;
+		struct wlr_box *box = wlr_output_layout_get_box(
+			server->output_layout, output->wlr_output);
+		struct wlr_box intersection;
+		if (view->indexed && box && output_scale > scale &&
+				wlr_box_intersection(&intersection, box, &view->index_box)) {
+			scale = output_scale;
+		}
+	}
+	return scale > 0.0f ? scale : highest;
+}
+
+static void view_index_update(struct tinywl_view *view) {
+	struct tinywl_server *server = view->server;
+	int lx, ly;
+	wlr_scene_node_coords(view->scene_node, &lx, &ly);
+
+	/* The frame covers the surface with its subsurfaces and, for decorated
+	 * views, the border which the titlebar and close button are drawn
+	 * inside of. */
+	struct wlr_box extents;
+	wlr_surface_get_extends(view->xdg_surface->surface, &extents);
+	int x1 = extents.x, y1 = extents.y;
+	int x2 = extents.x + extents.width, y2 = extents.y + extents.height;
+	if (view->border && view->border->node.state.enabled) {
+		struct wlr_scene_node *border = &view->border->node;
+		x1 = border->state.x < x1 ? border->state.x : x1;
+		y1 = border->state.y < y1 ? border->state.y : y1;
+		if (border->state.x + view->border->width > x2)
+			x2 = border->state.x + view->border->width;
+		if (border->state.y + view->border->height > y2)
+			y2 = border->state.y + view->border->height;
+	}
+	struct wlr_box box = { lx + x1, ly + y1, x2 - x1, y2 - y1 };
+
+	if (!view->indexed || memcmp(&box, &view->index_box, sizeof(box)) != 0) {
+		if (view->indexed)
+			spatial_index_remove(&server->view_index, view);
+		view->index_box = box;
+		if (box.width > 0 && box.height > 0)
+			spatial_index_insert(&server->view_index, view);
+		server->visibility_dirty = true;
+	}
+	/* Only the border is known to be opaque, the surface can have alpha */
+	if (view->border && view->border->node.state.enabled) {
+		view->opaque_box = (struct wlr_box){
+			lx + view->border->node.state.x, ly + view->border->node.state.y,
+			view->border->width, view->border->height,
+		};
+	} else {
+		view->opaque_box = (struct wlr_box){0};
+	}
+	/* Crossing onto an output with another scale renders the title again on
+	 * the next frame, or takes it from the cache if it was shown there. */
+	if (view->title.scale != 0.0f && view->title.scale != view_title_scale(view))
+		view_schedule_decorations(view);
+
+	if (view->child_count > 0) {
+		struct tinywl_view *child;
+		wl_list_for_each(child, &server->views, link) {
+			if (child->xdg_surface->toplevel->parent == view->xdg_surface)
+				view_index_update(child);
+		}
+	}
+}
+
+static void view_set_position(struct tinywl_view *view, int x, int y) {
+	view->x = x;
+	view->y = y;
+	wlr_scene_node_set_position(view->scene_node, view->x, view->y);
+	view_index_update(view);
+}
+
+static bool view_is_visible(struct tinywl_view *view) {
+	// Views behind a fullscreen view have their tree, or their parent's, disabled
+	for (struct wlr_scene_node *node = view->scene_node; node; node = node->parent) {
+		if (!node->state.enabled)
+			return false;
+	}
+	return true;
+}
+
+static bool node_box_contains(struct wlr_scene_node *node, int x, int y,
+		int width, int height, double px, double py) {
+	return px >= node->state.x + x && py >= node->state.y + y &&
+		px < node->state.x + x + width && py < node->state.y + y + height;
+}
+
+/* Finds the topmost scene node at the given layout coordinates. The view is
+ * found with the spatial index and its decorations from their geometry, the
+ * scene tree is only walked inside the surface tree to resolve subsurfaces. */
+static struct wlr_scene_node *desktop_node_at(struct tinywl_server *server,
+		double lx, double ly, double *sx, double *sy) {
+	server->hit_tests++;
+	if (server->opened_menu_view) {
+		struct wlr_scene_node *node = wlr_scene_node_at(
+			&server->view_menu->node, lx, ly, sx, sy);
+		if (node)
+			return node;
+	}
+	if (server->popup_count > 0) {
+		// Popups can reach outside of their view, fall back to the scene
+		server->hit_test_scene_walks++;
+		return wlr_scene_node_at(&server->scene->node, lx, ly, sx, sy);
+	}
+
+	struct wl_array *bucket = spatial_index_bucket(&server->view_index,
+		spatial_index_cell(lx), spatial_index_cell(ly));
+	struct tinywl_view *view = NULL, **entry;
+	wl_array_for_each(entry, bucket) {
+		struct wlr_box *box = &(*entry)->index_box;
+		if (lx >= box->x && ly >= box->y &&
+				lx < box->x + box->width && ly < box->y + box->height &&
+				(!view || view_is_above(*entry, view)) && view_is_visible(*entry)) {
+			view = *entry;
+		}
+	}
+	if (!view)
+		return NULL;
+
+	// Coordinates relative to the view
+	int view_lx, view_ly;
+	wlr_scene_node_coords(view->scene_node, &view_lx, &view_ly);
+	double vx = lx - view_lx, vy = ly - view_ly;
+	*sx = vx;
+	*sy = vy;
+
+	/* Subsurfaces can reach outside the main surface, so the whole tree is
+	 * tested. Its extents may have holes over the decorations, a miss there
+	 * falls through to them. */
+	struct wlr_box extents;
+	wlr_surface_get_extends(view->xdg_surface->surface, &extents);
+	if (vx >= extents.x && vy >= extents.y &&
+			vx < extents.x + extents.width && vy < extents.y + extents.height) {
+		struct wlr_scene_node *node = wlr_scene_node_at(view->scene_node,
+			lx - (view_lx - view->scene_node->state.x),
+			ly - (view_ly - view->scene_node->state.y), sx, sy);
+		if (node)
+			return node;
+		*sx = vx;
+		*sy = vy;
+	}
+	if (!view->border || !view->border->node.state.enabled)
+		return NULL;
+
+	struct wlr_scene_node *border = &view->border->node;
+	struct wlr_scene_node *titlebar = &view->titlebar->node;
+	// The titlebar is a child of the border and the close button of the titlebar
+	double tx = vx - border->state.x, ty = vy - border->state.y;
+	if (node_box_contains(&view->close_button->node,
+			titlebar->state.x, titlebar->state.y,
+			view->close_button->width, view->close_button->height, tx, ty)) {
+		return &view->close_button->node;
+	}
+	if (node_box_contains(titlebar, 0, 0,
+			view->titlebar->width, view->titlebar->height, tx, ty)) {
+		return titlebar;
+	}
+	return border;
+}
+
+static struct tinywl_output *output_from_wlr_output(
+		struct tinywl_server *server, struct wlr_output *wlr_output) {
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		if (output->wlr_output == wlr_output)
+			return output;
+	}
 	return NULL;
 }
 
+/* A fullscreen view is the only thing drawn on its output. The background and
+ * the views behind it are disabled so the scene can scan its buffer out. */
+static void update_fullscreen_visibility(struct tinywl_server *server) {
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		wlr_scene_node_set_enabled(&output->background->node,
+			output->fullscreen_view == NULL);
+	}
+	struct tinywl_view *view;
+	wl_list_for_each(view, &server->views, link) {
+		if (view_parent(view))
+			continue; // Dialogs are shown and hidden with their parent's tree
+		bool covered = false;
+		wl_list_for_each(output, &server->outputs, link) {
+			struct wlr_box *box = wlr_output_layout_get_box(
+				server->output_layout, output->wlr_output);
+			struct wlr_box intersection;
+			if (output->fullscreen_view && output->fullscreen_view != view &&
+					box && wlr_box_intersection(&intersection, box, &view->index_box)) {
+				covered = true;
+			}
+		}
+		wlr_scene_node_set_enabled(view->scene_node, !covered);
+	}
+	server->visibility_dirty = true;
+}
+
+/* Drops the interactive resize in flight. Configures the compositor sends on
+ * its own, like maximizing, supersede it and the client's ack of them would
+ * otherwise place the view at the stale resize box. */
+static void view_resize_cancel(struct tinywl_view *view) {
+	struct resize_transaction *resize = &view->resize;
+	resize->serial = 0;
+	resize->late_serial = 0;
+	resize->queued = false;
+	wl_event_source_timer_update(resize->timeout, 0);
+}
+
+/* Puts the view back where it was before going fullscreen. Unmapped views
+ * only drop the state, they have nothing to configure. */
+static void view_leave_fullscreen(struct tinywl_view *view, bool configure) {
+	struct tinywl_output *output = view->fullscreen_output;
+	if (!output)
+		return;
+	output->fullscreen_view = NULL;
+	view->fullscreen_output = NULL;
+	if (view->border)
+		wlr_scene_node_set_enabled(&view->border->node, true);
+	if (configure) {
+		view_resize_cancel(view);
+		view_set_position(view, view->fullscreen_saved.x, view->fullscreen_saved.y);
+		wlr_xdg_toplevel_set_size(view->xdg_surface,
+			view->fullscreen_saved.width, view->fullscreen_saved.height);
+		wlr_xdg_toplevel_set_fullscreen(view->xdg_surface, false);
+	}
+	update_fullscreen_visibility(view->server);
+}
+
+/* Focus only recolours the rects and swaps which title buffer is shown, both
+ * variants of the title are already rendered. */
+static void view_set_decorations_active(struct tinywl_view *view, bool active) {
+	const float *color = active ?
+		CONFIG.active_window_rgba : CONFIG.inactive_window_rgba;
+	wlr_scene_rect_set_color(view->border, color);
+	wlr_scene_rect_set_color(view->titlebar, color);
+	view->title.active = active;
+	for (int i = 0; i < 2; i++) {
+		if (view->title.buffers[i])
+			wlr_scene_node_set_enabled(&view->title.buffers[i]->node, i == active);
+	}
+}
+
 static void focus_view(struct tinywl_view *view, struct wlr_surface *surface) {
 	/* Note: this function only deals with keyboard focus. */
 	if (view == NULL) {
@@ -209,9 +1164,27 @@ static void focus_view(struct tinywl_view *view, struct wlr_surface *surface) {
 	}
 	struct tinywl_server *server = view->server;
 	struct wlr_seat *seat = server->seat;
+	uint64_t span = span_begin(server);
+	/* Focusing a view hidden behind a fullscreen view brings it back */
+	if (!view_is_visible(view)) {
+		struct tinywl_view *root = view, *parent;
+		while ((parent = view_parent(root)))
+			root = parent;
+		struct tinywl_output *output;
+		wl_list_for_each(output, &server->outputs, link) {
+			struct wlr_box *box = wlr_output_layout_get_box(
+				server->output_layout, output->wlr_output);
+			struct wlr_box intersection;
+			if (output->fullscreen_view && output->fullscreen_view != root &&
+					box && wlr_box_intersection(&intersection, box, &root->index_box)) {
+				view_leave_fullscreen(output->fullscreen_view, true);
+			}
+		}
+	}
 	struct wlr_surface *prev_surface = seat->keyboard_state.focused_surface;
 	if (prev_surface == surface) {
 		/* Don't re-focus an already focused surface. */
+		span_end(server, "focus_view", span);
 		return;
 	}
 	if (prev_surface) {
@@ -227,23 +1200,21 @@ static void focus_view(struct tinywl_view *view, struct wlr_surface *surface) {
 		/* Update the border to inactive color */
 		struct tinywl_view *focused_view = tinywl_view_from_wlr_surface(
 			server, prev_surface);
-		if (focused_view && focused_view->border){
-			wlr_scene_rect_set_color(focused_view->border, CONFIG.inactive_window_rgba);
-			wlr_scene_rect_set_color(focused_view->titlebar, CONFIG.inactive_window_rgba);
-		}
+		if (focused_view && focused_view->border)
+			view_set_decorations_active(focused_view, false);
 	}
 	struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(seat);
 	/* Move the view to the front */
 	wlr_scene_node_raise_to_top(view->scene_node);
 	wl_list_remove(&view->link);
 	wl_list_insert(&server->views, &view->link);
+	view->stack_serial = ++server->stack_serial;
+	server->visibility_dirty = true;
 	/* Activate the new surface */
 	wlr_xdg_toplevel_set_activated(view->xdg_surface, true);
 	/* Update the border to active color */
-	if (view->border){
-		wlr_scene_rect_set_color(view->border, CONFIG.active_window_rgba);
-		wlr_scene_rect_set_color(view->titlebar, CONFIG.active_window_rgba);
-	}
+	if (view->border)
+		view_set_decorations_active(view, true);
 	/*
 	 * Tell the seat to have the keyboard enter this surface. wlroots will keep
 	 * track of this and automatically send key events to the appropriate
@@ -251,6 +1222,7 @@ static void focus_view(struct tinywl_view *view, struct wlr_surface *surface) {
 	 */
 	wlr_seat_keyboard_notify_enter(seat, view->xdg_surface->surface,
 		keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
+	span_end(server, "focus_view", span);
 }
 
 static void save_view_geometry(struct tinywl_view *view){
@@ -263,60 +1235,60 @@ static void save_view_geometry(struct tinywl_view *view){
 	view->saved_geometry.width = view_geometry.width;
 }
 
+static bool view_place_at_edge(struct tinywl_view *view, enum wlr_edges edge){
+	struct wlr_output *output =
+		wlr_output_layout_output_at(view->server->output_layout,
+			view->server->cursor->x, view->server->cursor->y);
+	if (!output){ return false; }
+
+	int x, y, width, height;
+	x = CONFIG.border_size;
+	y = TITLEBAR_HEIGHT + CONFIG.border_size;
+	width = output->width - CONFIG.border_size*2;
+	height = output->height - (TITLEBAR_HEIGHT + CONFIG.border_size*2);
+
+	switch (edge) {
+	case WLR_EDGE_LEFT:
+		width = output->width/2 - CONFIG.border_size*2;
+		break;
+	case WLR_EDGE_RIGHT:
+		x = output->width/2 + CONFIG.border_size;
+		width = output->width/2 - CONFIG.border_size*2;
+		break;
+	case WLR_EDGE_BOTTOM:
+		y = output->height/2 + (TITLEBAR_HEIGHT + CONFIG.border_size);
+		height = output->height/2 - (TITLEBAR_HEIGHT + CONFIG.border_size*2);
+		break;
+	case WLR_EDGE_TOP:
+		height = output->height/2 - (TITLEBAR_HEIGHT + CONFIG.border_size*2);
+		break;
+	}
+
+	view_resize_cancel(view);
+	view_set_position(view, x, y);
+	wlr_xdg_toplevel_set_size(view->xdg_surface, width, height);
+	wlr_xdg_toplevel_set_maximized(view->xdg_surface, true);
+	return true;
+}
+
 bool maximize_view(struct tinywl_view *view, enum wlr_edges edge){
 	// Return false if the view is already maximized
-	if (view->xdg_surface->toplevel->current.maximized){
+	if (view->xdg_surface->toplevel->current.maximized || view->fullscreen_output){
 		return false;
-	} else {
-		/* Now that we can move from one maximized edge to another we don't want to
-		 * save the state in that case and just continue to use the old geometry */
-		if (view->server->cursor_mode != TINYWL_CURSOR_MOVE){
-			save_view_geometry(view);
-		};
-
-        struct wlr_output *output =
-            wlr_output_layout_output_at(view->server->output_layout,
-		        view->server->cursor->x, view->server->cursor->y);
-        if (!output){ return false; }
-
-		int x, y, width, height;
-		x = CONFIG.border_size;
-		y = TITLEBAR_HEIGHT + CONFIG.border_size;
-		width = output->width - CONFIG.border_size*2;
-		height = output->height - (TITLEBAR_HEIGHT + CONFIG.border_size*2);
-
-		switch (edge) {
-		case WLR_EDGE_LEFT:
-			width = output->width/2 - CONFIG.border_size*2;
-			break;
-		case WLR_EDGE_RIGHT:
-			x = output->width/2 + CONFIG.border_size;
-			width = output->width/2 - CONFIG.border_size*2;
-			break;
-		case WLR_EDGE_BOTTOM:
-			y = output->height/2 + (TITLEBAR_HEIGHT + CONFIG.border_size);
-			height = output->height/2 - (TITLEBAR_HEIGHT + CONFIG.border_size*2);
-			break;
-		case WLR_EDGE_TOP:
-			height = output->height/2 - (TITLEBAR_HEIGHT + CONFIG.border_size*2);
-			break;
-		}
-
-		view->x = x;
-		view->y = y;
-		wlr_scene_node_set_position(view->scene_node, view->x, view->y);
-		wlr_xdg_toplevel_set_size(view->xdg_surface, width, height);
-        wlr_xdg_toplevel_set_maximized(view->xdg_surface, true);
 	}
-	return true;
+	/* Now that we can move from one maximized edge to another we don't want to
+	 * save the state in that case and just continue to use the old geometry */
+	if (view->server->cursor_mode != TINYWL_CURSOR_MOVE){
+		save_view_geometry(view);
+	};
+	return view_place_at_edge(view, edge);
 }
 
 bool unmaximize_view(struct tinywl_view *view){
 	// Return false if the view is not maximized
-	if (view->xdg_surface->toplevel->current.maximized){
-        view->x = view->saved_geometry.x;
-        view->y = view->saved_geometry.y;
-	    wlr_scene_node_set_position(view->scene_node, view->x, view->y);
+	if (view->xdg_surface->toplevel->current.maximized && !view->fullscreen_output){
+        view_resize_cancel(view);
+        view_set_position(view, view->saved_geometry.x, view->saved_geometry.y);
         wlr_xdg_toplevel_set_size(view->xdg_surface, view->saved_geometry.width, view->saved_geometry.height);
         wlr_xdg_toplevel_set_maximized(view->xdg_surface, false);
     } else {
@@ -330,12 +1302,64 @@ void toggle_maximize(struct tinywl_view *view){
 		maximize_view(view, WLR_EDGE_NONE);
 }
 
-// Buffer logic from cagebreak
+static void view_enter_fullscreen(struct tinywl_view *view,
+		struct wlr_output *wlr_output) {
+	struct tinywl_server *server = view->server;
+	if (!wlr_output) {
+		wlr_output = wlr_output_layout_output_at(server->output_layout,
+			server->cursor->x, server->cursor->y);
+	}
+	struct tinywl_output *output = output_from_wlr_output(server, wlr_output);
+	struct wlr_box *box = output ? wlr_output_layout_get_box(
+		server->output_layout, wlr_output) : NULL;
+	// Dialogs are positioned relative to their parent, keep them windowed
+	if (!box || view_parent(view)) {
+		wlr_xdg_toplevel_set_fullscreen(view->xdg_surface, false);
+		return;
+	}
+	if (view->fullscreen_output == output)
+		return;
+
+	struct wlr_box geo_box;
+	wlr_xdg_surface_get_geometry(view->xdg_surface, &geo_box);
+	if (view->fullscreen_output) {
+		// Moving to another output, keep the geometry saved on entering
+		view->fullscreen_output->fullscreen_view = NULL;
+	} else {
+		view->fullscreen_saved = (struct wlr_box){
+			view->x, view->y, geo_box.width, geo_box.height,
+		};
+	}
+	if (output->fullscreen_view)
+		view_leave_fullscreen(output->fullscreen_view, true);
+	output->fullscreen_view = view;
+	view->fullscreen_output = output;
+
+	if (view->border)
+		wlr_scene_node_set_enabled(&view->border->node, false);
+	view_resize_cancel(view);
+	// The window geometry goes at the output origin, not the surface
+	view_set_position(view, box->x - geo_box.x, box->y - geo_box.y);
+	wlr_xdg_toplevel_set_size(view->xdg_surface, box->width, box->height);
+	wlr_xdg_toplevel_set_fullscreen(view->xdg_surface, true);
+	focus_view(view, view->xdg_surface->surface);
+	update_fullscreen_visibility(server);
+}
+
+/* Size in buffer pixels of a length in layout pixels, rounded up so the
+ * text is never cut off. */
+static int scaled_size(int length, float scale) {
+	int size = length * scale;
+	return size < length * scale ? size + 1 : size;
+}
+
+// Buffer logic from cagebreak. The text backend renders straight into the
+// pixels of the buffer so they are never copied.
 struct text_buffer {
 	struct wlr_buffer base;
 	void *data;
-	uint32_t format;
 	size_t stride;
+	uint32_t format;
 };
 
 static void text_buffer_destroy(struct wlr_buffer *wlr_buffer) {
@@ -348,7 +1372,7 @@ static bool text_buffer_begin_data_ptr_access(struct wlr_buffer *wlr_buffer,
 		uint32_t flags, void **data, uint32_t *format, size_t *stride) {
 	struct text_buffer *buffer = wl_container_of(wlr_buffer, buffer, base);
 	if(data != NULL) {
-		*data = (void *)buffer->data;
+		*data = buffer->data;
 	}
 	if(format != NULL) {
 		*format = buffer->format;
@@ -369,112 +1393,716 @@ static const struct wlr_buffer_impl text_buffer_impl = {
 	.end_data_ptr_access = text_buffer_end_data_ptr_access,
 };
 
-static struct text_buffer *text_buffer_create(uint32_t width, uint32_t height, uint32_t stride) {
+/* Opaque buffers are XRGB8888, the others ARGB8888 cleared to transparent.
+ * The stride is what both cairo and pixman expect for these formats. */
+static struct text_buffer *text_buffer_create(int width, int height,
+		bool opaque) {
 	struct text_buffer *buffer = calloc(1, sizeof(*buffer));
-	if (buffer == NULL) {
+	if (buffer == NULL)
+		return NULL;
+	buffer->stride = (size_t)width * 4;
+	// One byte at least so an empty title still gets a buffer
+	buffer->data = calloc(1, buffer->stride * height + 1);
+	if (buffer->data == NULL) {
+		free(buffer);
 		return NULL;
 	}
-
+	buffer->format = opaque ? DRM_FORMAT_XRGB8888 : DRM_FORMAT_ARGB8888;
 	wlr_buffer_init(&buffer->base, &text_buffer_impl, width, height);
-	buffer->format = DRM_FORMAT_ARGB8888;
-	buffer->stride = stride;
+	return buffer;
+}
 
-	buffer->data = malloc(buffer->stride * height);
-	if (buffer->data == NULL) {
-		free(buffer);
+#ifdef TINYWL_TEXT_FCFT
+/* Decodes UTF-8 into at most strlen(text) code points, bytes that don't form
+ * a valid sequence become U+FFFD. */
+static size_t utf8_decode(const char *text, uint32_t *out) {
+	const unsigned char *s = (const unsigned char *)text;
+	size_t count = 0;
+	while (*s) {
+		uint32_t cp;
+		int len;
+		if (*s < 0x80) {
+			cp = *s;
+			len = 1;
+		} else if ((*s & 0xe0) == 0xc0) {
+			cp = *s & 0x1f;
+			len = 2;
+		} else if ((*s & 0xf0) == 0xe0) {
+			cp = *s & 0x0f;
+			len = 3;
+		} else if ((*s & 0xf8) == 0xf0) {
+			cp = *s & 0x07;
+			len = 4;
+		} else {
+			out[count++] = 0xfffd;
+			s++;
+			continue;
+		}
+		int i;
+		for (i = 1; i < len && (s[i] & 0xc0) == 0x80; i++)
+			cp = cp << 6 | (s[i] & 0x3f);
+		out[count++] = i == len ? cp : 0xfffd;
+		s += i;
+	}
+	return count;
+}
+
+/* fcft takes fontconfig names, Pango's "Sans 12" becomes "Sans:size=12" */
+static void fcft_font_name(const char *description, char *name, size_t size) {
+	const char *space = strrchr(description, ' ');
+	char *end;
+	if (space && strtod(space + 1, &end) > 0 && *end == '\0') {
+		snprintf(name, size, "%.*s:size=%s", (int)(space - description),
+			description, space + 1);
+	} else {
+		snprintf(name, size, "%s", description);
+	}
+}
+
+/* fcft is set up once for all engines. The engine of the main thread is the
+ * first to be created and the last to go, the title workers' come and go in
+ * between. */
+static atomic_int fcft_engines;
+
+/* Fonts are sized for 96 dpi times the scale, like Pango does by default */
+static struct fcft_font *text_font_load(const char *name, float scale) {
+	char attributes[32];
+	snprintf(attributes, sizeof(attributes), "dpi=%.0f", 96 * scale);
+	return fcft_from_name(1, (const char *[]){ name }, attributes);
+}
+
+static bool text_engine_init(struct tinywl_text_engine *engine,
+		const char *font_str) {
+	*engine = (struct tinywl_text_engine){0};
+	if (atomic_fetch_add(&fcft_engines, 1) == 0)
+		fcft_init(FCFT_LOG_COLORIZE_AUTO, false, FCFT_LOG_CLASS_ERROR);
+	fcft_font_name(font_str, engine->name, sizeof(engine->name));
+	struct fcft_font *font = text_font_load(engine->name, 1.0f);
+	if (!font) {
+		wlr_log(WLR_ERROR, "Failed to load font %s", engine->name);
+		if (atomic_fetch_sub(&fcft_engines, 1) == 1)
+			fcft_fini();
+		return false;
+	}
+	engine->fonts[0] = (struct text_font){ .scale = 1.0f, .font = font };
+	engine->font_count = 1;
+	engine->foreground = pixman_image_create_solid_fill(
+		&(pixman_color_t){ 0xffff, 0xffff, 0xffff, 0xffff });
+	engine->line_height = font->ascent + font->descent;
+	return true;
+}
+
+static void text_engine_finish(struct tinywl_text_engine *engine) {
+	pixman_image_unref(engine->foreground);
+	for (int i = 0; i < engine->font_count; i++)
+		fcft_destroy(engine->fonts[i].font);
+	if (atomic_fetch_sub(&fcft_engines, 1) == 1)
+		fcft_fini();
+}
+
+/* Fonts for other scales are loaded on first use. With more scales than
+ * slots the last one is replaced, the font at scale 1 always stays. */
+static struct text_font *text_engine_font(struct tinywl_text_engine *engine,
+		float scale) {
+	for (int i = 0; i < engine->font_count; i++) {
+		if (engine->fonts[i].scale == scale)
+			return &engine->fonts[i];
+	}
+	struct fcft_font *font = text_font_load(engine->name, scale);
+	if (!font)
+		return &engine->fonts[0];
+	if (engine->font_count == TEXT_FONT_SCALES)
+		fcft_destroy(engine->fonts[--engine->font_count].font);
+	struct text_font *slot = &engine->fonts[engine->font_count++];
+	*slot = (struct text_font){ .scale = scale, .font = font };
+	return slot;
+}
+
+static const struct fcft_glyph *text_font_glyph(struct text_font *font,
+		uint32_t cp) {
+	if (cp >= 128)
+		return fcft_rasterize_char_utf32(font->font, cp, FCFT_SUBPIXEL_NONE);
+	if (!font->ascii[cp]) {
+		font->ascii[cp] =
+			fcft_rasterize_char_utf32(font->font, cp, FCFT_SUBPIXEL_NONE);
+	}
+	return font->ascii[cp];
+}
+
+/* Looks up the glyphs of the text, the caller frees the returned array */
+static const struct fcft_glyph **text_font_glyphs(struct text_font *font,
+		const char *text, size_t *count, int *width) {
+	size_t length = strlen(text);
+	uint32_t *cps = malloc((length + 1) * sizeof(*cps));
+	const struct fcft_glyph **glyphs = malloc((length + 1) * sizeof(*glyphs));
+	if (!cps || !glyphs) {
+		free(cps);
+		free(glyphs);
 		return NULL;
 	}
+	*count = utf8_decode(text, cps);
+	*width = 0;
+	for (size_t i = 0; i < *count; i++) {
+		glyphs[i] = text_font_glyph(font, cps[i]);
+		if (glyphs[i])
+			*width += glyphs[i]->advance.x;
+	}
+	free(cps);
+	return glyphs;
+}
 
-	return buffer;
+static void get_text_size(struct tinywl_text_engine *engine, const char *text,
+		int *width, int *height){
+	size_t count;
+	free(text_font_glyphs(&engine->fonts[0], text, &count, width));
+	*height = engine->line_height;
 }
 
-static void get_text_size(char *text, char *font_str, int *width, int *height){
-	cairo_surface_t *surface = cairo_image_surface_create(
-			CAIRO_FORMAT_ARGB32, 0, 0);
-	cairo_status_t status = cairo_surface_status(surface);
+static int text_draw_glyph(struct tinywl_text_engine *engine,
+		struct text_font *font, pixman_image_t *image,
+		const struct fcft_glyph *glyph, int x) {
+	if (!glyph)
+		return x;
+	int y = font->font->ascent - glyph->y;
+	if (pixman_image_get_format(glyph->pix) == PIXMAN_a8r8g8b8) {
+		// Colour glyphs like emoji bring their own colours
+		pixman_image_composite32(PIXMAN_OP_OVER, glyph->pix, NULL, image,
+			0, 0, 0, 0, x + glyph->x, y, glyph->width, glyph->height);
+	} else {
+		pixman_image_composite32(PIXMAN_OP_OVER, engine->foreground,
+			glyph->pix, image, 0, 0, 0, 0, x + glyph->x, y,
+			glyph->width, glyph->height);
+	}
+	return x + glyph->advance.x;
+}
 
-	cairo_t *cr = cairo_create(surface);
-	PangoLayout *layout;
-	PangoFontDescription *desc;
-
-	/* Create Pango layout. */
-	layout = pango_cairo_create_layout (cr);
-	desc = pango_font_description_from_string (font_str);
-	pango_layout_set_font_description (layout, desc);
-	pango_font_description_free (desc);
-	pango_layout_set_text (layout, text, -1);
-	/* Set width and height to text size */
-	pango_layout_get_pixel_size(layout, width, height);
+/* Text is drawn on the given opaque background, or on a transparent one when
+ * it is NULL. The size is in layout pixels, the buffer is that times scale.
+ * Text wider than the buffer is ellipsized in the middle like the Pango
+ * backend does. */
+static struct text_buffer * create_text_buffer(struct tinywl_text_engine *engine,
+		const char* text, int width, int height, const float *background,
+		float scale) {
+	struct text_font *font = text_engine_font(engine, scale);
+	width = scaled_size(width, scale);
+	height = scaled_size(height, scale);
+	struct text_buffer *buffer = text_buffer_create(width, height, background);
+	if (!buffer || width <= 0 || height <= 0)
+		return buffer;
+	pixman_image_t *image = pixman_image_create_bits_no_clear(
+		background ? PIXMAN_x8r8g8b8 : PIXMAN_a8r8g8b8, width, height,
+		buffer->data, buffer->stride);
+	if (background) {
+		pixman_color_t color = {
+			background[0] * 0xffff, background[1] * 0xffff,
+			background[2] * 0xffff, 0xffff,
+		};
+		pixman_image_fill_rectangles(PIXMAN_OP_SRC, image, &color, 1,
+			&(pixman_rectangle16_t){ 0, 0, width, height });
+	}
 
-	/* Cleanup */
-	cairo_surface_destroy(surface);
-	g_object_unref (layout);
-	cairo_destroy(cr);
+	size_t count;
+	int text_width;
+	const struct fcft_glyph **glyphs =
+		text_font_glyphs(font, text, &count, &text_width);
+	if (!glyphs) {
+		pixman_image_unref(image);
+		return buffer;
+	}
+	/* Glyphs [0, prefix) and [suffix, count) are drawn with the ellipsis in
+	 * between, taking from whichever end is shorter so far. */
+	size_t prefix = count, suffix = count;
+	const struct fcft_glyph *ellipsis = NULL;
+	if (text_width > width) {
+		ellipsis = text_font_glyph(font, 0x2026);
+		int available = width - (ellipsis ? ellipsis->advance.x : 0);
+		int left = 0, right = 0;
+		prefix = 0;
+		while (prefix < suffix) {
+			bool from_left = left <= right;
+			const struct fcft_glyph *glyph =
+				glyphs[from_left ? prefix : suffix - 1];
+			int advance = glyph ? glyph->advance.x : 0;
+			if (left + right + advance > available)
+				break;
+			if (from_left) {
+				left += advance;
+				prefix++;
+			} else {
+				right += advance;
+				suffix--;
+			}
+		}
+	}
+
+	int x = 0;
+	for (size_t i = 0; i < prefix; i++)
+		x = text_draw_glyph(engine, font, image, glyphs[i], x);
+	x = text_draw_glyph(engine, font, image, ellipsis, x);
+	for (size_t i = suffix; i < count; i++)
+		x = text_draw_glyph(engine, font, image, glyphs[i], x);
 
+	free(glyphs);
+	pixman_image_unref(image);
+	return buffer;
+}
+#else
+static bool text_engine_init(struct tinywl_text_engine *engine,
+		const char *font_str) {
+	engine->context = pango_font_map_create_context(
+		pango_cairo_font_map_get_default());
+	engine->font = pango_font_description_from_string(font_str);
+
+	engine->measure_layout = pango_layout_new(engine->context);
+	pango_layout_set_font_description(engine->measure_layout, engine->font);
+	engine->render_layout = pango_layout_new(engine->context);
+	pango_layout_set_font_description(engine->render_layout, engine->font);
+	pango_layout_set_ellipsize(engine->render_layout, PANGO_ELLIPSIZE_MIDDLE);
+
+	/* Every line of text has the same height for a given font so only the
+	 * width ever needs to be measured */
+	PangoFontMetrics *metrics =
+		pango_context_get_metrics(engine->context, engine->font, NULL);
+	engine->line_height = PANGO_PIXELS_CEIL(
+		pango_font_metrics_get_ascent(metrics) +
+		pango_font_metrics_get_descent(metrics));
+	pango_font_metrics_unref(metrics);
+	return true;
 }
 
-static struct text_buffer * create_text_buffer(char* text, int width, int height) {
-	cairo_surface_t *surface = cairo_image_surface_create(
-			CAIRO_FORMAT_ARGB32, width, height);
+static void text_engine_finish(struct tinywl_text_engine *engine) {
+	g_object_unref(engine->render_layout);
+	g_object_unref(engine->measure_layout);
+	pango_font_description_free(engine->font);
+	g_object_unref(engine->context);
+}
+
+static void get_text_size(struct tinywl_text_engine *engine, const char *text,
+		int *width, int *height){
+	pango_layout_set_text(engine->measure_layout, text, -1);
+	pango_layout_get_pixel_size(engine->measure_layout, width, NULL);
+	*height = engine->line_height;
+}
+
+/* Text is drawn on the given opaque background, or on a transparent one when
+ * it is NULL. The size is in layout pixels, the buffer is that times scale. */
+static struct text_buffer * create_text_buffer(struct tinywl_text_engine *engine,
+		const char* text, int width, int height, const float *background,
+		float scale) {
+	int buffer_width = scaled_size(width, scale);
+	int buffer_height = scaled_size(height, scale);
+	struct text_buffer *buffer =
+		text_buffer_create(buffer_width, buffer_height, background);
+	if (!buffer || buffer_width <= 0 || buffer_height <= 0)
+		return buffer;
+	cairo_surface_t *surface = cairo_image_surface_create_for_data(
+			buffer->data, background ? CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32,
+			buffer_width, buffer_height, buffer->stride);
 	cairo_status_t status = cairo_surface_status(surface);
 	if (status != CAIRO_STATUS_SUCCESS) {
 		wlr_log(WLR_ERROR, "cairo_image_surface_create failed: %s",
 			cairo_status_to_string(status));
+		cairo_surface_destroy(surface);
+		wlr_buffer_drop(&buffer->base);
 		return NULL;
 	}
 
 	cairo_t *cr = cairo_create(surface);
-	PangoLayout *layout;
-	PangoFontDescription *desc;
-
-	/* Set background to be transparent */
-	cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 0.0);
-	cairo_paint (cr);
-
-	/* Create Pango layout. */
-	layout = pango_cairo_create_layout (cr);
-	desc = pango_font_description_from_string (CONFIG.font_description);
-	pango_layout_set_font_description (layout, desc);
-	pango_font_description_free (desc);
+	PangoLayout *layout = engine->render_layout;
+
+	if (background) {
+		cairo_set_source_rgb(cr, background[0], background[1], background[2]);
+		cairo_paint (cr);
+	}
+	// Pango lays the text out in layout pixels and hints it for the scale
+	cairo_scale(cr, scale, scale);
+
+	/* Reuse the engine's layout, only the text and width change */
+	pango_cairo_update_context(cr, engine->context);
 	pango_layout_set_text (layout, text, -1);
 	pango_layout_set_width (layout, width * PANGO_SCALE);
-	pango_layout_set_ellipsize (layout, PANGO_ELLIPSIZE_MIDDLE);
 
 	/* Draw layout. */
 	cairo_set_source_rgb (cr, 1.0, 1.0, 1.0);
 	pango_cairo_show_layout (cr, layout);
 
-	//---
-	unsigned char *data = cairo_image_surface_get_data(surface);
-	int stride = cairo_image_surface_get_stride(surface);
-	struct text_buffer *buf=text_buffer_create(width, height, stride);
-	void *data_ptr;
+	cairo_destroy(cr);
+	cairo_surface_flush(surface);
+	cairo_surface_destroy(surface);
+	return buffer;
+}
+#endif
+
+/* Rasterized titles are kept in a small LRU cache so that resizing, refocusing
+ * or re-titling to a previously seen string reuses the existing buffer. The
+ * cache holds the creator's reference of each buffer while scene buffers take
+ * their own locks, so evicting an entry that is still shown is safe. */
+struct title_cache_entry {
+	struct wl_list link; // Most recently used first
+	char *text;
+	const char *font;
+	int width, height;
+	float scale;
+	float background[4];
+	struct wlr_buffer *buffer;
+};
+
+static void title_cache_entry_destroy(struct tinywl_server *server,
+		struct title_cache_entry *entry) {
+	wl_list_remove(&entry->link);
+	server->title_cache_length--;
+	wlr_buffer_drop(entry->buffer);
+	free(entry->text);
+	free(entry);
+}
+
+static void title_cache_finish(struct tinywl_server *server) {
+	struct title_cache_entry *entry, *tmp;
+	wl_list_for_each_safe(entry, tmp, &server->title_cache, link) {
+		title_cache_entry_destroy(server, entry);
+	}
+}
+
+static struct wlr_buffer *title_cache_find(struct tinywl_server *server,
+		const char *text, int width, int height, float scale,
+		const float background[4]) {
+	struct title_cache_entry *entry;
+	wl_list_for_each(entry, &server->title_cache, link) {
+		if (entry->width == width && entry->height == height &&
+				entry->scale == scale &&
+				memcmp(entry->background, background, sizeof(entry->background)) == 0 &&
+				strcmp(entry->font, CONFIG.font_description) == 0 &&
+				strcmp(entry->text, text) == 0) {
+			// Move the hit to the front so it is the last to be evicted
+			wl_list_remove(&entry->link);
+			wl_list_insert(&server->title_cache, &entry->link);
+			return entry->buffer;
+		}
+	}
+	return NULL;
+}
+
+/* Takes over the creator's reference of buf. Workers can finish the same
+ * title twice, then the entry already there is kept and buf dropped. */
+static struct wlr_buffer *title_cache_insert(struct tinywl_server *server,
+		const char *text, int width, int height, float scale,
+		const float background[4], struct text_buffer *buf) {
+	struct wlr_buffer *existing = title_cache_find(server, text, width, height,
+		scale, background);
+	if (existing) {
+		wlr_buffer_drop(&buf->base);
+		return existing;
+	}
+
+	if (server->title_cache_length >= CONFIG.title_cache_size) {
+		struct title_cache_entry *lru =
+			wl_container_of(server->title_cache.prev, lru, link);
+		title_cache_entry_destroy(server, lru);
+	}
 
-	if(!wlr_buffer_begin_data_ptr_access(&buf->base, WLR_BUFFER_DATA_PTR_ACCESS_WRITE,
-			&data_ptr, NULL, NULL)) {
-		wlr_log(WLR_ERROR, "Failed to get pointer access to text buffer");
+	struct title_cache_entry *entry = calloc(1, sizeof(struct title_cache_entry));
+	entry->text = strdup(text);
+	entry->font = CONFIG.font_description;
+	entry->width = width;
+	entry->height = height;
+	entry->scale = scale;
+	memcpy(entry->background, background, sizeof(entry->background));
+	entry->buffer = &buf->base;
+	wl_list_insert(&server->title_cache, &entry->link);
+	server->title_cache_length++;
+	return entry->buffer;
+}
+
+static struct wlr_buffer *title_cache_get(struct tinywl_server *server,
+		const char *text, int width, int height, float scale,
+		const float background[4]) {
+	struct wlr_buffer *buffer = title_cache_find(server, text, width, height,
+		scale, background);
+	if (buffer)
+		return buffer;
+
+	uint64_t start = profile_begin(server);
+	struct text_buffer *buf = create_text_buffer(&server->text_engine,
+		text, width, height, background, scale);
+	profile_end(server, &server->profile_text_render, start);
+	if (!buf)
 		return NULL;
+	return title_cache_insert(server, text, width, height, scale,
+		background, buf);
+}
+
+/* The buffer can be rendered at any scale, it is shown at the given size in
+ * layout pixels. */
+static void title_set_buffer(struct tinywl_view *view, bool active,
+		struct wlr_buffer *buf, int width, int height) {
+	struct wlr_scene_buffer *old_buffer = view->title.buffers[active];
+	// Keep the current title if it already shows this buffer or rendering failed
+	if (!buf || (old_buffer && old_buffer->buffer == buf))
+		return;
+
+	/* wlroots 0.15 can't swap the buffer of a scene buffer, so the node is
+	 * replaced. Its details move over to the new node instead of being freed
+	 * and allocated again. The title is part of the titlebar so it is hidden
+	 * along with the border, e.g. while the view is fullscreen. */
+	struct wlr_scene_buffer *scene_buffer =
+		wlr_scene_buffer_create(&view->titlebar->node, buf);
+	view->title.buffers[active] = scene_buffer;
+	if (old_buffer) {
+		node_move(old_buffer->node.data, &scene_buffer->node);
+		wlr_scene_node_destroy(&old_buffer->node);
+	} else {
+		node_init(view->server, &scene_buffer->node, TITLEBAR,
+			(void *)&view->titlebar->node, view, 0);
 	}
-	memcpy(data_ptr, data, stride*height);
-	wlr_buffer_end_data_ptr_access(&buf->base);
-	cairo_surface_destroy(surface);
-	//-----
 
-	/* free the layout object */
-	g_object_unref (layout);
-	cairo_destroy(cr);
-	return buf;
+	wlr_scene_buffer_set_dest_size(scene_buffer, width, height);
+	wlr_scene_node_set_position(&scene_buffer->node,
+		CONFIG.titlebar_padding, CONFIG.titlebar_padding);
+	wlr_scene_node_set_enabled(&scene_buffer->node, active == view->title.active);
+}
+
+static const float *title_background(bool active) {
+	return active ? CONFIG.active_window_rgba : CONFIG.inactive_window_rgba;
+}
+
+static void title_job_destroy(struct title_job *job) {
+	for (int i = 0; i < 2; i++) {
+		if (job->buffers[i])
+			wlr_buffer_drop(&job->buffers[i]->base);
+	}
+	free(job->text);
+	free(job);
+}
+
+static void *title_worker_run(void *data) {
+	struct title_workers *workers = data;
+	struct tinywl_text_engine engine;
+	bool engine_ok = text_engine_init(&engine, CONFIG.font_description);
+
+	pthread_mutex_lock(&workers->lock);
+	while (true) {
+		while (!workers->stopping && wl_list_empty(&workers->queue))
+			pthread_cond_wait(&workers->cond, &workers->lock);
+		if (workers->stopping)
+			break;
+		struct title_job *job =
+			wl_container_of(workers->queue.next, job, link);
+		wl_list_remove(&job->link);
+		job->started = true;
+		pthread_mutex_unlock(&workers->lock);
+
+		uint64_t span = span_begin(workers->server);
+		struct profile_counter render = {0};
+		uint64_t start = profile_begin(workers->server);
+		for (int i = 0; i < 2 && engine_ok; i++) {
+			job->buffers[i] = create_text_buffer(&engine, job->text,
+				job->width, job->height, title_background(i), job->scale);
+		}
+		profile_end(workers->server, &render, start);
+		span_end(workers->server, "title_render", span);
+
+		pthread_mutex_lock(&workers->lock);
+		workers->profile_render.calls += render.calls;
+		workers->profile_render.total_ns += render.total_ns;
+		if (render.max_ns > workers->profile_render.max_ns)
+			workers->profile_render.max_ns = render.max_ns;
+		wl_list_insert(workers->done.prev, &job->link);
+		uint64_t one = 1;
+		if (write(workers->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			wlr_log_errno(WLR_ERROR, "Failed to signal a finished title");
+	}
+	pthread_mutex_unlock(&workers->lock);
+
+	if (engine_ok)
+		text_engine_finish(&engine);
+	return NULL;
+}
+
+/* Finished titles go into the cache either way, they are only shown if the
+ * job still belongs to its view. */
+static int title_workers_done(int fd, uint32_t mask, void *data) {
+	struct tinywl_server *server = data;
+	struct title_workers *workers = &server->title_workers;
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		wlr_log_errno(WLR_ERROR, "Failed to read the title event fd");
+
+	struct wl_list done;
+	wl_list_init(&done);
+	pthread_mutex_lock(&workers->lock);
+	wl_list_insert_list(&done, &workers->done);
+	wl_list_init(&workers->done);
+	pthread_mutex_unlock(&workers->lock);
+
+	struct title_job *job, *tmp;
+	wl_list_for_each_safe(job, tmp, &done, link) {
+		wl_list_remove(&job->link);
+		if (job->view)
+			job->view->title_job = NULL;
+		for (int i = 0; i < 2; i++) {
+			if (!job->buffers[i])
+				continue;
+			struct wlr_buffer *buffer = title_cache_insert(server, job->text,
+				job->width, job->height, job->scale, title_background(i),
+				job->buffers[i]);
+			job->buffers[i] = NULL;
+			if (job->view) {
+				title_set_buffer(job->view, i, buffer,
+					job->width, job->height);
+			}
+		}
+		title_job_destroy(job);
+	}
+	return 0;
+}
+
+/* Queued jobs are dropped, one already rendering is left to finish into the
+ * cache without being shown. */
+static void view_title_job_cancel(struct tinywl_view *view) {
+	struct title_job *job = view->title_job;
+	if (!job)
+		return;
+	struct title_workers *workers = &view->server->title_workers;
+	view->title_job = NULL;
+	pthread_mutex_lock(&workers->lock);
+	bool started = job->started;
+	if (!started)
+		wl_list_remove(&job->link);
+	job->view = NULL;
+	pthread_mutex_unlock(&workers->lock);
+	if (!started)
+		title_job_destroy(job);
+}
+
+/* A title that is still queued is updated in place, so a burst of titles
+ * costs the view one rendering at most besides the one in progress. */
+static void view_title_job_submit(struct tinywl_view *view, const char *text,
+		int width, int height, float scale) {
+	struct title_workers *workers = &view->server->title_workers;
+	struct title_job *job = view->title_job;
+	if (job) {
+		pthread_mutex_lock(&workers->lock);
+		bool coalesced = !job->started;
+		if (coalesced) {
+			char *old_text = job->text;
+			job->text = strdup(text);
+			free(old_text);
+			job->width = width;
+			job->height = height;
+			job->scale = scale;
+		} else {
+			job->view = NULL;
+		}
+		pthread_mutex_unlock(&workers->lock);
+		if (coalesced) {
+			workers->coalesced++;
+			return;
+		}
+		workers->superseded++;
+	}
+
+	job = calloc(1, sizeof(struct title_job));
+	job->view = view;
+	job->text = strdup(text);
+	job->width = width;
+	job->height = height;
+	job->scale = scale;
+	view->title_job = job;
+	workers->submitted++;
+
+	pthread_mutex_lock(&workers->lock);
+	wl_list_insert(workers->queue.prev, &job->link);
+	pthread_cond_signal(&workers->cond);
+	pthread_mutex_unlock(&workers->lock);
+}
+
+/* Starts CONFIG.title_workers threads. Titles are rendered on the event loop
+ * instead if none of them could be started. */
+static void title_workers_init(struct tinywl_server *server) {
+	struct title_workers *workers = &server->title_workers;
+	workers->server = server;
+	wl_list_init(&workers->queue);
+	wl_list_init(&workers->done);
+	pthread_mutex_init(&workers->lock, NULL);
+	pthread_cond_init(&workers->cond, NULL);
+	workers->event_fd = -1;
+	if (CONFIG.title_workers <= 0)
+		return;
+
+	workers->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	workers->threads = calloc(CONFIG.title_workers, sizeof(pthread_t));
+	if (workers->event_fd < 0 || !workers->threads) {
+		wlr_log(WLR_ERROR, "Rendering titles without workers");
+		return;
+	}
+	workers->source = wl_event_loop_add_fd(
+		wl_display_get_event_loop(server->wl_display), workers->event_fd,
+		WL_EVENT_READABLE, title_workers_done, server);
+	/* Signals are handled by the event loop, which only blocks them in the
+	 * main thread. Workers start with all of them blocked so none is ever
+	 * delivered to a worker instead. */
+	sigset_t all, previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	for (int i = 0; i < CONFIG.title_workers; i++) {
+		if (pthread_create(&workers->threads[i], NULL, title_worker_run,
+				workers) != 0) {
+			break;
+		}
+		workers->count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+/* Called once the views are gone, unfinished jobs belong to nobody */
+static void title_workers_finish(struct title_workers *workers) {
+	pthread_mutex_lock(&workers->lock);
+	workers->stopping = true;
+	pthread_cond_broadcast(&workers->cond);
+	pthread_mutex_unlock(&workers->lock);
+	for (int i = 0; i < workers->count; i++)
+		pthread_join(workers->threads[i], NULL);
+
+	struct title_job *job, *tmp;
+	wl_list_for_each_safe(job, tmp, &workers->queue, link)
+		title_job_destroy(job);
+	wl_list_for_each_safe(job, tmp, &workers->done, link)
+		title_job_destroy(job);
+	if (workers->source)
+		wl_event_source_remove(workers->source);
+	if (workers->event_fd >= 0)
+		close(workers->event_fd);
+	free(workers->threads);
+	pthread_cond_destroy(&workers->cond);
+	pthread_mutex_destroy(&workers->lock);
 }
 
 static void view_title_update(struct tinywl_view *view,
 		char* title_str){
-	if (view->title.buffer)
-		wlr_scene_node_destroy(&view->title.buffer->node);
+	// Dialogs are drawn without decorations, there is no titlebar to put it in
+	if (!view->titlebar)
+		return;
+	uint64_t span = span_begin(view->server);
+	if (!title_str)
+		title_str = "";
 
+	// Only measure the title again if the string itself changed
 	int width, height;
-	get_text_size(title_str, CONFIG.font_description, &width, &height);
-	TITLEBAR_HEIGHT = height + CONFIG.titlebar_padding * 2;
-	view->title.original_width = width;
+	if (!view->title.text || strcmp(view->title.text, title_str) != 0) {
+		uint64_t start = profile_begin(view->server);
+		get_text_size(&view->server->text_engine, title_str, &width, &height);
+		profile_end(view->server, &view->server->profile_text_measure, start);
+		size_t size = strlen(title_str) + 1;
+		if (size > view->title.text_size) {
+			free(view->title.text);
+			view->title.text = malloc(size);
+			view->title.text_size = size;
+		}
+		memcpy(view->title.text, title_str, size);
+		view->title.original_width = width;
+	}
+	width = view->title.original_width;
+	height = view->server->text_engine.line_height;
 
 	int pending_width =
 		view->xdg_surface->surface->current.width - CONFIG.border_size  - CONFIG.deco_button_size;
@@ -482,15 +2110,26 @@ static void view_title_update(struct tinywl_view *view,
 		width = pending_width;
 	view->title.current_width = width;
 
-	struct text_buffer *buf = create_text_buffer(title_str, width, height);
-	struct wlr_scene_buffer *text_scene_buffer = malloc(sizeof(struct wlr_scene_buffer));
-	view->title.buffer = wlr_scene_buffer_create(view->scene_node, &buf->base);
-	view->title.buffer->node.data = node_init(TITLEBAR,
-		(void *)&view->titlebar->node, view, 0);
-
-	wlr_scene_node_set_position(&view->title.buffer->node,
-		CONFIG.titlebar_padding,
-		CONFIG.titlebar_padding - TITLEBAR_HEIGHT);
+	/* Titles already in the cache are shown right away, anything else is
+	 * rendered by the workers and the old title stays up meanwhile. */
+	struct tinywl_server *server = view->server;
+	float scale = view->title.scale = view_title_scale(view);
+	struct wlr_buffer *cached[2];
+	for (int active = 0; active < 2; active++) {
+		cached[active] = title_cache_find(server, title_str, width, height,
+			scale, title_background(active));
+	}
+	if (server->title_workers.count > 0 && (!cached[0] || !cached[1])) {
+		view_title_job_submit(view, title_str, width, height, scale);
+	} else {
+		view_title_job_cancel(view);
+		for (int active = 0; active < 2; active++) {
+			title_set_buffer(view, active, cached[active] ? cached[active] :
+				title_cache_get(server, title_str, width, height, scale,
+				title_background(active)), width, height);
+		}
+	}
+	span_end(view->server, "view_title_update", span);
 }
 
 static void xdg_toplevel_set_title(struct wl_listener *listener, void *data){
@@ -516,12 +2155,25 @@ static void position_view_centered(struct tinywl_view *view){
     if (main_width){
 		struct wlr_box view_geometry;
 		wlr_xdg_surface_get_geometry(view->xdg_surface, &view_geometry);
-        view->x = main_width/2 - view_geometry.width/2;
-        view->y = main_height/2 - view_geometry.height/2;
-        wlr_scene_node_set_position(view->scene_node, view->x, view->y);
+        view_set_position(view, main_width/2 - view_geometry.width/2,
+            main_height/2 - view_geometry.height/2);
     };
 }
 
+static void trace_record(struct tinywl_server *server, struct trace_event *event) {
+	/* Frames carry no time of their own, they get the one of the pointer
+	 * event they close so the whole trace is on the device clock. */
+	if (event->type == TRACE_FRAME)
+		event->time_msec = server->trace_pointer_time_msec;
+	else if (event->type != TRACE_KEY)
+		server->trace_pointer_time_msec = event->time_msec;
+	if (fwrite(event, sizeof(*event), 1, server->trace_record) != 1) {
+		wlr_log(WLR_ERROR, "Failed to write input trace, stopping recording");
+		fclose(server->trace_record);
+		server->trace_record = NULL;
+	}
+}
+
 static void keyboard_handle_modifiers(
 		struct wl_listener *listener, void *data) {
 	/* This event is raised when a modifier key, such as shift or alt, is
@@ -534,25 +2186,224 @@ static void keyboard_handle_modifiers(
 	 * same seat. You can swap out the underlying wlr_keyboard like this and
 	 * wlr_seat handles this transparently.
 	 */
-	wlr_seat_set_keyboard(keyboard->server->seat, keyboard->device);
+	wlr_seat_set_keyboard(keyboard->server->seat, keyboard->group->input_device);
 	/* Send modifiers to the client. */
 	wlr_seat_keyboard_notify_modifiers(keyboard->server->seat,
-		&keyboard->device->keyboard->modifiers);
+		&keyboard->group->keyboard.modifiers);
+}
+
+/* Only these take part in bindings, lock modifiers are ignored */
+#define KEYBINDING_MODIFIERS (WLR_MODIFIER_SHIFT | WLR_MODIFIER_CTRL | \
+	WLR_MODIFIER_ALT | WLR_MODIFIER_LOGO)
+
+/* Used when there is no keybindings file. Same format, one binding per line:
+ * modifiers and key joined by '+', the action and its argument. */
+static const char *default_keybindings =
+	"Alt+Escape exit\n"
+	"Alt+F1 cycle\n";
+
+static size_t keybinding_slot(struct keybinding_table *table,
+		uint32_t modifiers, xkb_keysym_t sym) {
+	uint64_t key = (uint64_t)modifiers << 32 | sym;
+	return (key * 0x9e3779b97f4a7c15ull >> 32) & (table->size - 1);
+}
+
+static struct keybinding *keybinding_lookup(struct keybinding_table *table,
+		uint32_t modifiers, xkb_keysym_t sym) {
+	if (!table->size)
+		return NULL;
+	sym = xkb_keysym_to_lower(sym);
+	for (size_t i = keybinding_slot(table, modifiers, sym);;
+			i = (i + 1) & (table->size - 1)) {
+		struct keybinding *binding = &table->slots[i];
+		if (binding->sym == XKB_KEY_NoSymbol)
+			return NULL;
+		if (binding->modifiers == modifiers && binding->sym == sym)
+			return binding;
+	}
+}
+
+static bool keybinding_parse(char *line, struct keybinding *binding) {
+	static const struct { const char *name; uint32_t mask; } modifier_names[] = {
+		{ "Shift", WLR_MODIFIER_SHIFT }, { "Ctrl", WLR_MODIFIER_CTRL },
+		{ "Control", WLR_MODIFIER_CTRL }, { "Alt", WLR_MODIFIER_ALT },
+		{ "Mod1", WLR_MODIFIER_ALT }, { "Super", WLR_MODIFIER_LOGO },
+		{ "Logo", WLR_MODIFIER_LOGO }, { "Mod4", WLR_MODIFIER_LOGO },
+	};
+	static const struct { const char *name; enum wlr_edges edge; } edge_names[] = {
+		{ "left", WLR_EDGE_LEFT }, { "right", WLR_EDGE_RIGHT },
+		{ "top", WLR_EDGE_TOP }, { "bottom", WLR_EDGE_BOTTOM },
+	};
+
+	char *saveptr;
+	char *keys = strtok_r(line, " \t", &saveptr);
+	char *action = strtok_r(NULL, " \t", &saveptr);
+	char *argument = strtok_r(NULL, "", &saveptr);
+	if (!keys || !action)
+		return false;
+	while (argument && (*argument == ' ' || *argument == '\t'))
+		argument++;
+
+	*binding = (struct keybinding){0};
+	char *key, *keys_saveptr;
+	for (key = strtok_r(keys, "+", &keys_saveptr); key;
+			key = strtok_r(NULL, "+", &keys_saveptr)) {
+		if (binding->sym != XKB_KEY_NoSymbol)
+			return false; // The key has to come last
+		size_t i;
+		for (i = 0; i < sizeof(modifier_names) / sizeof(*modifier_names); i++) {
+			if (strcasecmp(key, modifier_names[i].name) == 0) {
+				binding->modifiers |= modifier_names[i].mask;
+				break;
+			}
+		}
+		if (i == sizeof(modifier_names) / sizeof(*modifier_names)) {
+			binding->sym = xkb_keysym_to_lower(
+				xkb_keysym_from_name(key, XKB_KEYSYM_CASE_INSENSITIVE));
+			if (binding->sym == XKB_KEY_NoSymbol)
+				return false;
+		}
+	}
+	if (binding->sym == XKB_KEY_NoSymbol)
+		return false;
+
+	if (strcmp(action, "exit") == 0) {
+		binding->action = ACTION_EXIT;
+	} else if (strcmp(action, "cycle") == 0) {
+		binding->action = ACTION_CYCLE;
+	} else if (strcmp(action, "maximize") == 0) {
+		binding->action = ACTION_MAXIMIZE;
+	} else if (strcmp(action, "close") == 0) {
+		binding->action = ACTION_CLOSE;
+	} else if (strcmp(action, "spawn") == 0 && argument && *argument) {
+		binding->action = ACTION_SPAWN;
+		binding->command = strdup(argument);
+	} else if (strcmp(action, "move_to_edge") == 0 && argument) {
+		binding->action = ACTION_MOVE_TO_EDGE;
+		for (size_t i = 0; i < sizeof(edge_names) / sizeof(*edge_names); i++) {
+			if (strcmp(argument, edge_names[i].name) == 0)
+				binding->edge = edge_names[i].edge;
+		}
+		if (binding->edge == WLR_EDGE_NONE)
+			return false;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static void keybinding_insert(struct keybinding_table *table,
+		struct keybinding *binding) {
+	size_t i = keybinding_slot(table, binding->modifiers, binding->sym);
+	while (table->slots[i].sym != XKB_KEY_NoSymbol &&
+			(table->slots[i].modifiers != binding->modifiers ||
+			table->slots[i].sym != binding->sym)) {
+		i = (i + 1) & (table->size - 1);
+	}
+	if (table->slots[i].sym != XKB_KEY_NoSymbol) {
+		// A later line for the same keys replaces the earlier one
+		free(table->slots[i].command);
+	} else {
+		table->count++;
+	}
+	table->slots[i] = *binding;
 }
 
-static bool handle_keybinding(struct tinywl_server *server, xkb_keysym_t sym) {
+/* Builds the binding table from the keybindings file, or from the defaults
+ * when there is none. Lines that can't be parsed are logged and skipped. */
+static void keybindings_load(struct keybinding_table *table, const char *path) {
+	FILE *file = NULL;
+	char *buffer = NULL;
+	if (path) {
+		file = fopen(path, "r");
+		if (!file)
+			wlr_log(WLR_ERROR, "Failed to open keybindings %s, using defaults", path);
+	}
+	if (!file)
+		file = fmemopen(buffer = strdup(default_keybindings),
+			strlen(default_keybindings), "r");
+
+	struct wl_array bindings;
+	wl_array_init(&bindings);
+	char *line = NULL;
+	size_t line_size = 0;
+	int line_number = 0;
+	while (getline(&line, &line_size, file) != -1) {
+		line_number++;
+		line[strcspn(line, "#\n")] = '\0';
+		if (line[strspn(line, " \t")] == '\0')
+			continue;
+		struct keybinding binding = {0};
+		if (!keybinding_parse(line, &binding)) {
+			wlr_log(WLR_ERROR, "Invalid keybinding on line %d of %s", line_number,
+				buffer ? "the defaults" : path);
+			free(binding.command);
+			continue;
+		}
+		struct keybinding *entry = wl_array_add(&bindings, sizeof(binding));
+		*entry = binding;
+	}
+	free(line);
+	fclose(file);
+	free(buffer);
+
+	size_t count = bindings.size / sizeof(struct keybinding);
+	table->size = 16;
+	while (table->size < count * 2)
+		table->size *= 2;
+	table->slots = calloc(table->size, sizeof(struct keybinding));
+	table->count = 0;
+	struct keybinding *binding;
+	wl_array_for_each(binding, &bindings) {
+		keybinding_insert(table, binding);
+	}
+	wl_array_release(&bindings);
+}
+
+static void keybindings_finish(struct keybinding_table *table) {
+	for (size_t i = 0; i < table->size; i++)
+		free(table->slots[i].command);
+	free(table->slots);
+	*table = (struct keybinding_table){0};
+}
+
+/* Replaces a forked child with the command. The signals the event loop
+ * handles are blocked and the mask would be inherited across exec. */
+static void exec_command(const char *command) {
+	sigset_t empty;
+	sigemptyset(&empty);
+	sigprocmask(SIG_SETMASK, &empty, NULL);
+	execl("/bin/sh", "/bin/sh", "-c", command, (void *)NULL);
+	_exit(1);
+}
+
+static void spawn_command(const char *command) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		// Fork again so the command is reparented and never left a zombie
+		setsid();
+		if (fork() == 0)
+			exec_command(command);
+		_exit(0);
+	} else if (pid > 0) {
+		waitpid(pid, NULL, 0);
+	}
+}
+
+static void keybinding_run(struct tinywl_server *server,
+		struct keybinding *binding) {
 	/*
 	 * Here we handle compositor keybindings. This is when the compositor is
 	 * processing keys, rather than passing them on to the client for its own
 	 * processing.
-	 *
-	 * This function assumes Alt is held down.
 	 */
-	switch (sym) {
-	case XKB_KEY_Escape:
+	struct tinywl_view *focused_view = tinywl_view_from_wlr_surface(
+		server, server->seat->keyboard_state.focused_surface);
+	switch (binding->action) {
+	case ACTION_EXIT:
 		wl_display_terminate(server->wl_display);
 		break;
-	case XKB_KEY_F1:
+	case ACTION_CYCLE:
 		/* Cycle to the next view */
 		if (wl_list_length(&server->views) < 2) {
 			break;
@@ -561,10 +2412,27 @@ static bool handle_keybinding(struct tinywl_server *server, xkb_keysym_t sym) {
 			server->views.prev, next_view, link);
 		focus_view(next_view, next_view->xdg_surface->surface);
 		break;
-	default:
-		return false;
+	case ACTION_MAXIMIZE:
+		if (focused_view)
+			toggle_maximize(focused_view);
+		break;
+	case ACTION_CLOSE:
+		if (focused_view)
+			wlr_xdg_toplevel_send_close(focused_view->xdg_surface);
+		break;
+	case ACTION_SPAWN:
+		spawn_command(binding->command);
+		break;
+	case ACTION_MOVE_TO_EDGE:
+		if (!focused_view || focused_view->fullscreen_output)
+			break;
+		// Going from one edge to another keeps the geometry from before
+		if (focused_view->xdg_surface->toplevel->current.maximized)
+			view_place_at_edge(focused_view, binding->edge);
+		else
+			maximize_view(focused_view, binding->edge);
+		break;
 	}
-	return true;
 }
 
 static void keyboard_handle_key(
@@ -575,61 +2443,153 @@ static void keyboard_handle_key(
 	struct tinywl_server *server = keyboard->server;
 	struct wlr_event_keyboard_key *event = data;
 	struct wlr_seat *seat = server->seat;
+	if (server->trace_record) {
+		trace_record(server, &(struct trace_event){
+			.type = TRACE_KEY, .time_msec = event->time_msec,
+			.key = { event->keycode, event->state }});
+	}
 
 	/* Translate libinput keycode -> xkbcommon */
 	uint32_t keycode = event->keycode + 8;
 	/* Get a list of keysyms based on the keymap for this keyboard */
+	struct xkb_state *xkb_state = keyboard->group->keyboard.xkb_state;
 	const xkb_keysym_t *syms;
-	int nsyms = xkb_state_key_get_syms(
-			keyboard->device->keyboard->xkb_state, keycode, &syms);
+	int nsyms = xkb_state_key_get_syms(xkb_state, keycode, &syms);
+	/* Bindings name keys by their unshifted keysym, Shift+Tab has to match
+	 * on Tab and not on the ISO_Left_Tab it translates to. The first level
+	 * of the key is looked up first, then the translated keysyms. */
+	const xkb_keysym_t *raw_syms;
+	int raw_nsyms = xkb_keymap_key_get_syms_by_level(
+		keyboard->group->keyboard.keymap, keycode,
+		xkb_state_key_get_layout(xkb_state, keycode), 0, &raw_syms);
 
 	bool handled = false;
-	uint32_t modifiers = wlr_keyboard_get_modifiers(keyboard->device->keyboard);
-	if ((modifiers & WLR_MODIFIER_ALT) &&
-			event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
-		/* If alt is held down and this button was _pressed_, we attempt to
-		 * process it as a compositor keybinding. */
-		for (int i = 0; i < nsyms; i++) {
-			handled = handle_keybinding(server, syms[i]);
+	uint32_t modifiers = wlr_keyboard_get_modifiers(&keyboard->group->keyboard) &
+		KEYBINDING_MODIFIERS;
+	if (event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+		/* If this button was _pressed_, we look it up in the binding table and
+		 * run the first binding found as a compositor keybinding. */
+		for (int i = 0; i < raw_nsyms + nsyms && !handled; i++) {
+			struct keybinding *binding = keybinding_lookup(&server->keybindings,
+				modifiers, i < raw_nsyms ? raw_syms[i] : syms[i - raw_nsyms]);
+			if (binding) {
+				keybinding_run(server, binding);
+				handled = true;
+			}
 		}
 	}
 
 	if (!handled) {
 		/* Otherwise, we pass it along to the client. */
-		wlr_seat_set_keyboard(seat, keyboard->device);
+		wlr_seat_set_keyboard(seat, keyboard->group->input_device);
 		wlr_seat_keyboard_notify_key(seat, event->time_msec,
 			event->keycode, event->state);
 	}
 }
 
-static void server_new_keyboard(struct tinywl_server *server,
-		struct wlr_input_device *device) {
-	struct tinywl_keyboard *keyboard =
-		calloc(1, sizeof(struct tinywl_keyboard));
-	keyboard->server = server;
-	keyboard->device = device;
+static struct xkb_rule_names keyboard_rule_names(struct wlr_input_device *device) {
+	/* Every device uses the XKB_DEFAULT_* settings (e.g. layout = "us" when
+	 * unset). Per device settings would be picked here. */
+	return (struct xkb_rule_names){
+		.rules = getenv("XKB_DEFAULT_RULES"),
+		.model = getenv("XKB_DEFAULT_MODEL"),
+		.layout = getenv("XKB_DEFAULT_LAYOUT"),
+		.variant = getenv("XKB_DEFAULT_VARIANT"),
+		.options = getenv("XKB_DEFAULT_OPTIONS"),
+	};
+}
+
+static bool rule_name_equal(const char *a, const char *b) {
+	return strcmp(a ? a : "", b ? b : "") == 0;
+}
+
+static char *rule_name_dup(const char *name) {
+	return name ? strdup(name) : NULL;
+}
+
+/* Finds the keyboard group for the names, compiling the keymap only when no
+ * connected keyboard has used them yet. */
+static struct tinywl_keyboard *keyboard_group_get(struct tinywl_server *server,
+		const struct xkb_rule_names *names) {
+	struct tinywl_keyboard *keyboard;
+	wl_list_for_each(keyboard, &server->keyboards, link) {
+		if (rule_name_equal(keyboard->names.rules, names->rules) &&
+				rule_name_equal(keyboard->names.model, names->model) &&
+				rule_name_equal(keyboard->names.layout, names->layout) &&
+				rule_name_equal(keyboard->names.variant, names->variant) &&
+				rule_name_equal(keyboard->names.options, names->options)) {
+			return keyboard;
+		}
+	}
 
-	/* We need to prepare an XKB keymap and assign it to the keyboard. This
-	 * assumes the defaults (e.g. layout = "us"). */
-	struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-	struct xkb_keymap *keymap = xkb_keymap_new_from_names(context, NULL,
-		XKB_KEYMAP_COMPILE_NO_FLAGS);
+	struct xkb_keymap *keymap = xkb_keymap_new_from_names(server->xkb_context,
+		names, XKB_KEYMAP_COMPILE_NO_FLAGS);
+	if (!keymap) {
+		wlr_log(WLR_ERROR, "Failed to compile keymap for layout %s",
+			names->layout ? names->layout : "(default)");
+		return NULL;
+	}
 
-	wlr_keyboard_set_keymap(device->keyboard, keymap);
+	keyboard = calloc(1, sizeof(struct tinywl_keyboard));
+	keyboard->server = server;
+	keyboard->names = (struct xkb_rule_names){
+		.rules = rule_name_dup(names->rules),
+		.model = rule_name_dup(names->model),
+		.layout = rule_name_dup(names->layout),
+		.variant = rule_name_dup(names->variant),
+		.options = rule_name_dup(names->options),
+	};
+	keyboard->group = wlr_keyboard_group_create();
+	wlr_keyboard_set_keymap(&keyboard->group->keyboard, keymap);
 	xkb_keymap_unref(keymap);
-	xkb_context_unref(context);
-	wlr_keyboard_set_repeat_info(device->keyboard, 25, 600);
+	wlr_keyboard_set_repeat_info(&keyboard->group->keyboard, 25, 600);
 
 	/* Here we set up listeners for keyboard events. */
 	keyboard->modifiers.notify = keyboard_handle_modifiers;
-	wl_signal_add(&device->keyboard->events.modifiers, &keyboard->modifiers);
+	wl_signal_add(&keyboard->group->keyboard.events.modifiers, &keyboard->modifiers);
 	keyboard->key.notify = keyboard_handle_key;
-	wl_signal_add(&device->keyboard->events.key, &keyboard->key);
-
-	wlr_seat_set_keyboard(server->seat, device);
+	wl_signal_add(&keyboard->group->keyboard.events.key, &keyboard->key);
 
 	/* And add the keyboard to our list of keyboards */
 	wl_list_insert(&server->keyboards, &keyboard->link);
+	return keyboard;
+}
+
+static void keyboard_groups_finish(struct tinywl_server *server) {
+	struct tinywl_keyboard *keyboard, *tmp;
+	wl_list_for_each_safe(keyboard, tmp, &server->keyboards, link) {
+		wl_list_remove(&keyboard->modifiers.link);
+		wl_list_remove(&keyboard->key.link);
+		wl_list_remove(&keyboard->link);
+		wlr_keyboard_group_destroy(keyboard->group);
+		free((char *)keyboard->names.rules);
+		free((char *)keyboard->names.model);
+		free((char *)keyboard->names.layout);
+		free((char *)keyboard->names.variant);
+		free((char *)keyboard->names.options);
+		free(keyboard);
+	}
+	xkb_context_unref(server->xkb_context);
+}
+
+static void server_new_keyboard(struct tinywl_server *server,
+		struct wlr_input_device *device) {
+	/* We need to prepare an XKB keymap and assign it to the keyboard. Devices
+	 * with the same settings share the keymap of their group, and the group
+	 * removes them by itself once they are destroyed. */
+	struct xkb_rule_names names = keyboard_rule_names(device);
+	struct tinywl_keyboard *keyboard = keyboard_group_get(server, &names);
+	if (!keyboard)
+		return;
+
+	wlr_keyboard_set_keymap(device->keyboard, keyboard->group->keyboard.keymap);
+	wlr_keyboard_set_repeat_info(device->keyboard, 25, 600);
+	if (!wlr_keyboard_group_add_keyboard(keyboard->group, device->keyboard)) {
+		wlr_log(WLR_ERROR, "Failed to add %s to its keyboard group", device->name);
+		return;
+	}
+
+	wlr_seat_set_keyboard(server->seat, keyboard->group->input_device);
 }
 
 static void server_new_pointer(struct tinywl_server *server,
@@ -667,6 +2627,58 @@ static void server_new_input(struct wl_listener *listener, void *data) {
 	wlr_seat_set_capabilities(server->seat, caps);
 }
 
+static void cursor_forget_surface(struct tinywl_server *server) {
+	if (server->cursor_surface_set && server->cursor_surface)
+		wl_list_remove(&server->cursor_surface_destroy.link);
+	server->cursor_surface_set = false;
+	server->cursor_surface = NULL;
+}
+
+static void cursor_surface_destroy(struct wl_listener *listener, void *data) {
+	struct tinywl_server *server =
+		wl_container_of(listener, server, cursor_surface_destroy);
+	// The cursor no longer shows anything known, the next image is always set
+	cursor_forget_surface(server);
+}
+
+static void cursor_set_xcursor(struct tinywl_server *server, const char *name) {
+	if (server->cursor_image && strcmp(server->cursor_image, name) == 0) {
+		server->cursor_image_skipped++;
+		return;
+	}
+	uint64_t start = profile_begin(server);
+	cursor_forget_surface(server);
+	server->cursor_image = name;
+	wlr_xcursor_manager_set_cursor_image(server->cursor_mgr, name, server->cursor);
+	profile_end(server, &server->profile_cursor_image, start);
+}
+
+static void cursor_set_surface(struct tinywl_server *server,
+		struct wlr_surface *surface, int32_t hotspot_x, int32_t hotspot_y) {
+	/* Clients set their cursor again on every pointer enter. The cursor
+	 * follows commits to the surface by itself, so the same surface and
+	 * hotspot leave nothing to do. */
+	if (server->cursor_surface_set && server->cursor_surface == surface &&
+			server->cursor_hotspot_x == hotspot_x &&
+			server->cursor_hotspot_y == hotspot_y) {
+		server->cursor_image_skipped++;
+		return;
+	}
+	uint64_t start = profile_begin(server);
+	cursor_forget_surface(server);
+	server->cursor_image = NULL;
+	server->cursor_surface_set = true;
+	server->cursor_surface = surface;
+	server->cursor_hotspot_x = hotspot_x;
+	server->cursor_hotspot_y = hotspot_y;
+	if (surface) {
+		server->cursor_surface_destroy.notify = cursor_surface_destroy;
+		wl_signal_add(&surface->events.destroy, &server->cursor_surface_destroy);
+	}
+	wlr_cursor_set_surface(server->cursor, surface, hotspot_x, hotspot_y);
+	profile_end(server, &server->profile_cursor_image, start);
+}
+
 static void seat_request_cursor(struct wl_listener *listener, void *data) {
 	struct tinywl_server *server = wl_container_of(
 			listener, server, request_cursor);
@@ -681,7 +2693,7 @@ static void seat_request_cursor(struct wl_listener *listener, void *data) {
 		 * provided surface as the cursor image. It will set the hardware cursor
 		 * on the output that it's currently on and continue to do so as the
 		 * cursor moves between outputs. */
-		wlr_cursor_set_surface(server->cursor, event->surface,
+		cursor_set_surface(server, event->surface,
 				event->hotspot_x, event->hotspot_y);
 	}
 }
@@ -700,33 +2712,33 @@ static void seat_request_set_selection(struct wl_listener *listener, void *data)
 static struct tinywl_view *desktop_view_at(struct tinywl_server *server,
 		double lx, double ly, double *sx, double *sy, void **scene_node,
 		struct tinywl_node_details **tinywl_node_details) {
+	uint64_t start = profile_begin(server);
+	struct tinywl_view *view = NULL;
+
 	/* This returns the topmost node in the scene at the given layout coords. */
-	struct wlr_scene_node *node = wlr_scene_node_at(
-		&server->scene->node, lx, ly, sx, sy);
+	struct wlr_scene_node *node = desktop_node_at(server, lx, ly, sx, sy);
 
 	*scene_node = node;
 
-	if (node == NULL || (!node->data && node->type != WLR_SCENE_NODE_SURFACE)) {
-		return NULL;
-	} else if (node->type == WLR_SCENE_NODE_SURFACE){
+	if (node && node->type == WLR_SCENE_NODE_SURFACE){
 		//*surface = wlr_scene_surface_from_node(node)->surface;
         /* Find the node corresponding to the tinywl_view at the root of this
          * surface tree, it is the only one for which we set the data field. */
         while (node != NULL && node->data == NULL) {
                 node = node->parent;
         }
-        return node->data;
-	}
-
-	struct tinywl_node_details *details = node->data;
-	if (details){
+        view = node->data;
+	} else if (node && node->data) {
+		struct tinywl_node_details *details = node->data;
 		*tinywl_node_details = details;
 		if (!details->view && server->opened_menu_view)
-			return server->opened_menu_view;
-		return details->view;
-	} else {
-		return NULL;
+			view = server->opened_menu_view;
+		else
+			view = details->view;
 	}
+
+	profile_end(server, &server->profile_view_at, start);
+	return view;
 }
 
 static void process_cursor_move(struct tinywl_server *server, uint32_t time) {
@@ -749,10 +2761,71 @@ static void process_cursor_move(struct tinywl_server *server, uint32_t time) {
 		unmaximize_view(view);
 
 		/* Move the grabbed view to the new position. */
-		view->x = server->cursor->x - server->grab_x;
-		view->y = server->cursor->y - server->grab_y;
-		wlr_scene_node_set_position(view->scene_node, view->x, view->y);
+		view_set_position(view, server->cursor->x - server->grab_x,
+			server->cursor->y - server->grab_y);
+	}
+}
+
+static void view_send_resize(struct tinywl_view *view, struct wlr_box *box,
+		uint32_t edges) {
+	struct resize_transaction *resize = &view->resize;
+	resize->box = *box;
+	resize->edges = edges;
+	resize->serial = wlr_xdg_toplevel_set_size(view->xdg_surface,
+		box->width, box->height);
+	wl_event_source_timer_update(resize->timeout, CONFIG.resize_timeout_ms);
+}
+
+static void view_request_resize(struct tinywl_view *view, struct wlr_box *box,
+		uint32_t edges) {
+	struct resize_transaction *resize = &view->resize;
+	if (resize->serial) {
+		resize->queued = true;
+		resize->queued_box = *box;
+		resize->queued_edges = edges;
+		return;
+	}
+	view_send_resize(view, box, edges);
+}
+
+static void view_place_resized(struct tinywl_view *view, struct wlr_box *box,
+		uint32_t edges) {
+	/* Place the view using the size the client actually committed, keeping
+	 * the edges that are not being dragged where they were. */
+	struct wlr_box geo_box;
+	wlr_xdg_surface_get_geometry(view->xdg_surface, &geo_box);
+	int x = (edges & WLR_EDGE_LEFT) ?
+		box->x + box->width - geo_box.width : box->x;
+	int y = (edges & WLR_EDGE_TOP) ?
+		box->y + box->height - geo_box.height : box->y;
+	view_set_position(view, x - geo_box.x, y - geo_box.y);
+}
+
+static void view_apply_resize(struct tinywl_view *view) {
+	struct resize_transaction *resize = &view->resize;
+	view_place_resized(view, &resize->box, resize->edges);
+
+	resize->serial = 0;
+	wl_event_source_timer_update(resize->timeout, 0);
+	if (resize->queued) {
+		resize->queued = false;
+		view_send_resize(view, &resize->queued_box, resize->queued_edges);
+	}
+}
+
+static int view_resize_timeout(void *data) {
+	/* The client didn't commit the configure in time, don't let it stall the
+	 * resize and carry on with what it has committed so far. */
+	struct tinywl_view *view = data;
+	struct resize_transaction *resize = &view->resize;
+	if (resize->serial) {
+		// Its size still has to be placed once the client commits it
+		resize->late_serial = resize->serial;
+		resize->late_box = resize->box;
+		resize->late_edges = resize->edges;
+		view_apply_resize(view);
 	}
+	return 0;
 }
 
 static void process_cursor_resize(struct tinywl_server *server, uint32_t time) {
@@ -762,9 +2835,8 @@ static void process_cursor_resize(struct tinywl_server *server, uint32_t time) {
 	 * on one or two axes, but can also move the view if you resize from the top
 	 * or left edges (or top-left corner).
 	 *
-	 * Note that I took some shortcuts here. In a more fleshed-out compositor,
-	 * you'd wait for the client to prepare a buffer at the new size, then
-	 * commit any movement that was prepared.
+	 * The new size is only sent to the client here, the view is moved once the
+	 * client commits a buffer at that size, see view_apply_resize.
 	 */
 	struct tinywl_view *view = server->grabbed_view;
 	double border_x = server->cursor->x - server->grab_x;
@@ -797,15 +2869,10 @@ static void process_cursor_resize(struct tinywl_server *server, uint32_t time) {
 		}
 	}
 
-	struct wlr_box geo_box;
-	wlr_xdg_surface_get_geometry(view->xdg_surface, &geo_box);
-	view->x = new_left - geo_box.x;
-	view->y = new_top - geo_box.y;
-	wlr_scene_node_set_position(view->scene_node, view->x, view->y);
-
-	int new_width = new_right - new_left;
-	int new_height = new_bottom - new_top;
-	wlr_xdg_toplevel_set_size(view->xdg_surface, new_width, new_height);
+	struct wlr_box box = {
+		new_left, new_top, new_right - new_left, new_bottom - new_top,
+	};
+	view_request_resize(view, &box, server->resize_edges);
 }
 
 enum wlr_edges find_resize_edge(struct tinywl_view *view,
@@ -832,17 +2899,8 @@ enum wlr_edges find_resize_edge(struct tinywl_view *view,
 static void begin_interactive(struct tinywl_view *view,
 		enum tinywl_cursor_mode mode, uint32_t edges);
 
-static void process_cursor_motion(struct tinywl_server *server, uint32_t time) {
-	/* If the mode is non-passthrough, delegate to those functions. */
-	if (server->cursor_mode == TINYWL_CURSOR_MOVE) {
-		process_cursor_move(server, time);
-		return;
-	} else if (server->cursor_mode == TINYWL_CURSOR_RESIZE) {
-		process_cursor_resize(server, time);
-		return;
-	}
-
-	/* Otherwise, find the view under the pointer and send the event along. */
+static void process_cursor_passthrough(struct tinywl_server *server, uint32_t time) {
+	/* Find the view under the pointer and send the event along. */
 	double sx, sy;
 	struct wlr_seat *seat = server->seat;
 	void *scene_node;
@@ -852,8 +2910,7 @@ static void process_cursor_motion(struct tinywl_server *server, uint32_t time) {
 			&scene_node, &tinywl_node_details);
 
 	if (tinywl_node_details && tinywl_node_details->type == MENU){
-		wlr_xcursor_manager_set_cursor_image(
-			server->cursor_mgr, "left_ptr", server->cursor);
+		cursor_set_xcursor(server, "left_ptr");
         if (tinywl_node_details->owner &&
 				server->selected_menu_item != tinywl_node_details->owner){
 			if (server->selected_menu_item){
@@ -875,19 +2932,16 @@ static void process_cursor_motion(struct tinywl_server *server, uint32_t time) {
 		/* If there's no view under the cursor, set the cursor image to a
 		 * default. This is what makes the cursor image appear when you move it
 		 * around the screen, not over any views. */
-		wlr_xcursor_manager_set_cursor_image(
-				server->cursor_mgr, "left_ptr", server->cursor);
+		cursor_set_xcursor(server, "left_ptr");
 	} else if(tinywl_node_details &&
 			(tinywl_node_details->type == TITLEBAR &&
 			server->cursor_mode == TINYWL_CURSOR_PRESSED)){
-        wlr_xcursor_manager_set_cursor_image(
-            server->cursor_mgr, "move", server->cursor);
+        cursor_set_xcursor(server, "move");
         server->seat->pointer_state.focused_surface = view->xdg_surface->surface;
         begin_interactive(view, TINYWL_CURSOR_MOVE, 0);
     } else if (tinywl_node_details && tinywl_node_details->type == BORDER){
         enum wlr_edges edge = find_resize_edge(view, view->xdg_surface->surface);
-        wlr_xcursor_manager_set_cursor_image(
-            server->cursor_mgr, wlr_xcursor_get_resize_name(edge), server->cursor);
+        cursor_set_xcursor(server, wlr_xcursor_get_resize_name(edge));
     }
 
 	if (server->cursor_mode == TINYWL_CURSOR_PRESSED && view != server->grabbed_view) {
@@ -921,12 +2975,52 @@ static void process_cursor_motion(struct tinywl_server *server, uint32_t time) {
 	}
 }
 
+static void process_cursor_motion(struct tinywl_server *server, uint32_t time) {
+	uint64_t start = profile_begin(server);
+	uint64_t span = span_begin(server);
+	/* If the mode is non-passthrough, delegate to those functions. */
+	if (server->cursor_mode == TINYWL_CURSOR_MOVE) {
+		process_cursor_move(server, time);
+	} else if (server->cursor_mode == TINYWL_CURSOR_RESIZE) {
+		process_cursor_resize(server, time);
+	} else {
+		process_cursor_passthrough(server, time);
+	}
+	span_end(server, "process_cursor_motion", span);
+	profile_end(server, &server->profile_cursor_motion, start);
+}
+
+/* High polling rate mice send many motion events per input frame, but only
+ * the final cursor position matters. When coalescing, the cursor is moved
+ * right away and the hit-test, move/resize and seat notifications run once
+ * per frame, or before anything which depends on them. */
+static void queue_cursor_motion(struct tinywl_server *server, uint32_t time) {
+	if (!CONFIG.coalesce_motion) {
+		process_cursor_motion(server, time);
+		return;
+	}
+	server->motion_pending = true;
+	server->motion_pending_time = time;
+}
+
+static void flush_cursor_motion(struct tinywl_server *server) {
+	if (server->motion_pending) {
+		server->motion_pending = false;
+		process_cursor_motion(server, server->motion_pending_time);
+	}
+}
+
 static void server_cursor_motion(struct wl_listener *listener, void *data) {
 	/* This event is forwarded by the cursor when a pointer emits a _relative_
 	 * pointer motion event (i.e. a delta) */
 	struct tinywl_server *server =
 		wl_container_of(listener, server, cursor_motion);
 	struct wlr_event_pointer_motion *event = data;
+	if (server->trace_record) {
+		trace_record(server, &(struct trace_event){
+			.type = TRACE_MOTION, .time_msec = event->time_msec,
+			.motion = { event->delta_x, event->delta_y }});
+	}
 	/* The cursor doesn't move unless we tell it to. The cursor automatically
 	 * handles constraining the motion to the output layout, as well as any
 	 * special configuration applied for the specific input device which
@@ -934,7 +3028,13 @@ static void server_cursor_motion(struct wl_listener *listener, void *data) {
 	 * the cursor around without any input. */
 	wlr_cursor_move(server->cursor, event->device,
 			event->delta_x, event->delta_y);
-	process_cursor_motion(server, event->time_msec);
+	/* Clients using relative pointer (games etc.) get every delta, even when
+	 * the hit-testing below is coalesced. */
+	wlr_relative_pointer_manager_v1_send_relative_motion(
+		server->relative_pointer_manager, server->seat,
+		(uint64_t)event->time_msec * 1000, event->delta_x, event->delta_y,
+		event->unaccel_dx, event->unaccel_dy);
+	queue_cursor_motion(server, event->time_msec);
 }
 
 static void server_cursor_motion_absolute(
@@ -948,8 +3048,13 @@ static void server_cursor_motion_absolute(
 	struct tinywl_server *server =
 		wl_container_of(listener, server, cursor_motion_absolute);
 	struct wlr_event_pointer_motion_absolute *event = data;
+	if (server->trace_record) {
+		trace_record(server, &(struct trace_event){
+			.type = TRACE_MOTION_ABSOLUTE, .time_msec = event->time_msec,
+			.motion_absolute = { event->x, event->y }});
+	}
 	wlr_cursor_warp_absolute(server->cursor, event->device, event->x, event->y);
-	process_cursor_motion(server, event->time_msec);
+	queue_cursor_motion(server, event->time_msec);
 }
 
 static int number_of_clicks(uint32_t button, uint32_t time_msec){
@@ -970,12 +3075,10 @@ static int number_of_clicks(uint32_t button, uint32_t time_msec){
     return clicked;
 }
 
-static void server_cursor_button(struct wl_listener *listener, void *data) {
-	/* This event is forwarded by the cursor when a pointer emits a button
-	 * event. */
-	struct tinywl_server *server =
-		wl_container_of(listener, server, cursor_button);
-	struct wlr_event_pointer_button *event = data;
+static void process_cursor_button(struct tinywl_server *server,
+		struct wlr_event_pointer_button *event) {
+	/* The button must go to whatever is under the latest cursor position */
+	flush_cursor_motion(server);
 	/* Notify the client with pointer focus that a button press has occurred */
 	wlr_seat_pointer_notify_button(server->seat,
 			event->time_msec, event->button, event->state);
@@ -1051,12 +3154,35 @@ static void server_cursor_button(struct wl_listener *listener, void *data) {
 	}
 }
 
+static void server_cursor_button(struct wl_listener *listener, void *data) {
+	/* This event is forwarded by the cursor when a pointer emits a button
+	 * event. */
+	struct tinywl_server *server =
+		wl_container_of(listener, server, cursor_button);
+	struct wlr_event_pointer_button *event = data;
+	if (server->trace_record) {
+		trace_record(server, &(struct trace_event){
+			.type = TRACE_BUTTON, .time_msec = event->time_msec,
+			.button = { event->button, event->state }});
+	}
+	uint64_t span = span_begin(server);
+	process_cursor_button(server, event);
+	span_end(server, "server_cursor_button", span);
+}
+
 static void server_cursor_axis(struct wl_listener *listener, void *data) {
 	/* This event is forwarded by the cursor when a pointer emits an axis event,
 	 * for example when you move the scroll wheel. */
 	struct tinywl_server *server =
 		wl_container_of(listener, server, cursor_axis);
 	struct wlr_event_pointer_axis *event = data;
+	if (server->trace_record) {
+		trace_record(server, &(struct trace_event){
+			.type = TRACE_AXIS, .time_msec = event->time_msec,
+			.axis = { event->delta, event->delta_discrete,
+				event->orientation, event->source }});
+	}
+	flush_cursor_motion(server);
 	/* Notify the client with pointer focus of the axis event. */
 	wlr_seat_pointer_notify_axis(server->seat,
 			event->time_msec, event->orientation, event->delta,
@@ -1070,25 +3196,429 @@ static void server_cursor_frame(struct wl_listener *listener, void *data) {
 	 * same time, in which case a frame event won't be sent in between. */
 	struct tinywl_server *server =
 		wl_container_of(listener, server, cursor_frame);
+	if (server->trace_record)
+		trace_record(server, &(struct trace_event){ .type = TRACE_FRAME });
+	flush_cursor_motion(server);
 	/* Notify the client with pointer focus of the frame event. */
 	wlr_seat_pointer_notify_frame(server->seat);
 }
 
+static int64_t timespec_diff_ns(const struct timespec *start,
+		const struct timespec *end) {
+	return (int64_t)(end->tv_sec - start->tv_sec) * 1000000000 +
+		(end->tv_nsec - start->tv_nsec);
+}
+
+static void frame_stats_add(struct frame_stats *stats, uint64_t ns) {
+	uint64_t bucket = ns / FRAME_HISTOGRAM_BUCKET_NS;
+	if (bucket >= FRAME_HISTOGRAM_BUCKETS)
+		bucket = FRAME_HISTOGRAM_BUCKETS - 1;
+	stats->histogram[bucket]++;
+	stats->frames++;
+	stats->total_ns += ns;
+	if (ns > stats->max_ns)
+		stats->max_ns = ns;
+}
+
+/* Returns the upper bound of the bucket holding the given percentile */
+static double frame_stats_percentile_ms(struct frame_stats *stats,
+		double percentile) {
+	uint64_t target = stats->frames * percentile / 100.0;
+	uint64_t seen = 0;
+	for (int i = 0; i < FRAME_HISTOGRAM_BUCKETS; i++) {
+		seen += stats->histogram[i];
+		if (seen > target)
+			return (i + 1) * FRAME_HISTOGRAM_BUCKET_NS / 1e6;
+	}
+	return stats->max_ns / 1e6;
+}
+
+static void timespec_add_ns(struct timespec *ts, int64_t ns) {
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+	if (ts->tv_nsec < 0) {
+		ts->tv_sec--;
+		ts->tv_nsec += 1000000000;
+	}
+}
+
+static void update_view_visibility(struct tinywl_server *server) {
+	/* Walk the views from the top, a view is occluded when everything it
+	 * draws is covered by the opaque frames of the views above it. */
+	pixman_region32_t covered;
+	pixman_region32_init(&covered);
+	struct tinywl_view *view;
+	wl_list_for_each(view, &server->views, link) {
+		struct wlr_box *box = &view->index_box;
+		pixman_box32_t extents = {
+			box->x, box->y, box->x + box->width, box->y + box->height,
+		};
+		// Dialogs are drawn above their parent whatever the list order is
+		view->occluded = !view_is_visible(view) || (!view_parent(view) &&
+			view->indexed && pixman_region32_contains_rectangle(
+				&covered, &extents) == PIXMAN_REGION_IN);
+		if (view->opaque_box.width > 0) {
+			pixman_region32_union_rect(&covered, &covered,
+				view->opaque_box.x, view->opaque_box.y,
+				view->opaque_box.width, view->opaque_box.height);
+		}
+	}
+	pixman_region32_fini(&covered);
+	server->visibility_dirty = false;
+}
+
+static void send_frame_done_iterator(struct wlr_surface *surface,
+		int sx, int sy, void *data) {
+	wlr_surface_send_frame_done(surface, data);
+}
+
+/* A view spanning several outputs gets its frame callbacks from the one
+ * showing the largest part of it, not once per output it touches. */
+static struct tinywl_output *view_frame_output(struct tinywl_view *view) {
+	struct tinywl_server *server = view->server;
+	struct tinywl_output *output, *best = NULL;
+	int64_t best_area = 0;
+	wl_list_for_each(output, &server->outputs, link) {
+		struct wlr_box *box = wlr_output_layout_get_box(
+			server->output_layout, output->wlr_output);
+		struct wlr_box intersection;
+		if (!box || !wlr_box_intersection(&intersection, box, &view->index_box))
+			continue;
+		int64_t area = (int64_t)intersection.width * intersection.height;
+		if (area > best_area) {
+			best = output;
+			best_area = area;
+		}
+	}
+	return best;
+}
+
+static void output_send_frame_done(struct tinywl_output *output,
+		struct timespec *now) {
+	struct tinywl_server *server = output->server;
+	if (server->visibility_dirty)
+		update_view_visibility(server);
+
+	struct tinywl_view *view;
+	wl_list_for_each(view, &server->views, link) {
+		if (view_frame_output(view) != output)
+			continue;
+		if (server->throttle_occluded && view->occluded && timespec_diff_ns(&view->last_frame_done, now) <
+				(int64_t)CONFIG.occluded_frame_interval_ms * 1000000) {
+			view->frames_throttled++;
+			continue;
+		}
+		view->last_frame_done = *now;
+		wlr_xdg_surface_for_each_surface(view->xdg_surface,
+			send_frame_done_iterator, now);
+	}
+}
+
+static enum scanout_status output_scanout_status(struct tinywl_output *output) {
+	struct tinywl_view *view = output->fullscreen_view;
+	struct wlr_surface *surface = view->xdg_surface->surface;
+	struct wlr_output *wlr_output = output->wlr_output;
+	if (!surface->buffer)
+		return SCANOUT_NO_BUFFER;
+	if (view->child_count > 0 || view->server->opened_menu_view ||
+			!wl_list_empty(&view->xdg_surface->popups) ||
+			!wl_list_empty(&surface->current.subsurfaces_below) ||
+			!wl_list_empty(&surface->current.subsurfaces_above)) {
+		return SCANOUT_OTHER_SURFACES;
+	}
+	if (surface->current.scale != wlr_output->scale ||
+			surface->current.transform != wlr_output->transform) {
+		return SCANOUT_SCALE_TRANSFORM;
+	}
+	/* The surface sits at the view position, its buffer has to cover the
+	 * output exactly. Clients that keep a window geometry offset, like CSD
+	 * shadows, when fullscreen don't. */
+	struct wlr_box *box = wlr_output_layout_get_box(
+		output->server->output_layout, wlr_output);
+	if (!box || view->x != box->x || view->y != box->y ||
+			surface->current.buffer_width != wlr_output->width ||
+			surface->current.buffer_height != wlr_output->height) {
+		return SCANOUT_GEOMETRY;
+	}
+	return SCANOUT_DIRECT;
+}
+
+static void output_commit(struct wl_listener *listener, void *data) {
+	struct tinywl_output *output = wl_container_of(listener, output, commit);
+	struct wlr_output_event_commit *event = data;
+	if (!output->scanout_pending || !(event->committed & WLR_OUTPUT_STATE_BUFFER))
+		return;
+	enum scanout_status status = output->scanout_expected;
+	if (status == SCANOUT_DIRECT && event->buffer != output->scanout_candidate)
+		status = SCANOUT_REJECTED;
+	output->scanout[status]++;
+}
+
+static void view_update_decorations(struct tinywl_view *view) {
+	/* This runs at frame time, the committed geometry is the one to follow.
+	 * The pending one may already hold geometry the client hasn't
+	 * committed yet. */
+	int geo_width = view->decoration_state.geometry.width;
+	int geo_height = view->decoration_state.geometry.height;
+
+	// Only render a new title if the width of the view is different than title
+	// or it moved to an output with another scale
+	if (geo_width - CONFIG.deco_button_size < view->title.current_width ||
+			(view->title.current_width != view->title.original_width &&
+			view->title.current_width != geo_width - CONFIG.border_size - CONFIG.deco_button_size) ||
+			(view->title.scale != 0.0f &&
+			view->title.scale != view_title_scale(view))){
+		view_title_update(view, view->xdg_surface->toplevel->title);
+	}
+
+	if (view->border && (geo_width != view->border->width ||
+			geo_height != view->border->height - TITLEBAR_HEIGHT - CONFIG.border_size)){
+		wlr_scene_rect_set_size(view->border, geo_width + (CONFIG.border_size*2),
+			geo_height + TITLEBAR_HEIGHT + (CONFIG.border_size*2));
+		wlr_scene_rect_set_size(view->titlebar, geo_width,
+			TITLEBAR_HEIGHT);
+	}
+
+	if (view->close_button){
+		wlr_scene_node_set_position(&view->close_button->node,
+			geo_width - view->close_button->width,
+			TITLEBAR_HEIGHT/2 - view->close_button->height/2);
+	}
+
+	if (view->indexed)
+		view_index_update(view);
+}
+
+/* Commits only note that the geometry of a view changed, the decorations
+ * follow once per frame right before the scene is rendered. The new surface
+ * content doesn't show before that render either, so the border and
+ * titlebar still never lag behind the surface when it is resized. */
+static void flush_decorations(struct tinywl_server *server) {
+	struct tinywl_view *view, *tmp;
+	wl_list_for_each_safe(view, tmp, &server->decorations_dirty,
+			decoration_link) {
+		uint64_t start = profile_begin(server);
+		view->decoration_dirty = false;
+		wl_list_remove(&view->decoration_link);
+		view_update_decorations(view);
+		profile_end(server, &server->profile_decorations, start);
+	}
+}
+
+static void output_render(struct tinywl_output *output) {
+	uint64_t span = span_begin(output->server);
+	struct wlr_scene *scene = output->server->scene;
+	struct frame_schedule *schedule = &output->schedule;
+
+	struct wlr_scene_output *scene_output = wlr_scene_get_scene_output(
+		scene, output->wlr_output);
+
+	/* Not every pointer device sends frame events, catch up on its motion
+	 * before rendering so the frame shows the latest state */
+	flush_cursor_motion(output->server);
+	flush_decorations(output->server);
+
+	/* The scene scans the fullscreen view out by itself when it is the only
+	 * node on the output, predict whether that can work and why not. */
+	if (output->fullscreen_view) {
+		output->scanout_pending = true;
+		output->scanout_expected = output_scanout_status(output);
+		output->scanout_candidate = output->scanout_expected == SCANOUT_DIRECT ?
+			&output->fullscreen_view->xdg_surface->surface->buffer->base : NULL;
+	}
+
+	/* Render the scene if needed and commit the output */
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bool committed = wlr_scene_output_commit(scene_output);
+	output->scanout_pending = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t render_ns = timespec_diff_ns(&start, &now);
+	frame_stats_add(&output->frame_stats, render_ns);
+	if (render_ns > schedule->render_estimate_ns) {
+		schedule->render_estimate_ns = render_ns;
+	} else {
+		schedule->render_estimate_ns -=
+			(schedule->render_estimate_ns - render_ns) / 16;
+	}
+	if (schedule->has_deadline && timespec_diff_ns(&schedule->deadline, &now) > 0)
+		schedule->missed_deadlines++;
+	schedule->has_deadline = false;
+
+	/* The scene sends the presentation feedback to clients, here we only keep
+	 * count of what made it into a frame on this output. Hidden and occluded
+	 * views weren't drawn, their content stays pending. */
+	if (committed) {
+		struct tinywl_server *server = output->server;
+		if (server->visibility_dirty)
+			update_view_visibility(server);
+		struct wlr_box *output_box = wlr_output_layout_get_box(
+			server->output_layout, output->wlr_output);
+		struct tinywl_view *view, *tmp;
+		wl_list_for_each_safe(view, tmp, &server->present_pending,
+				present_link) {
+			struct wlr_box intersection;
+			if (view->occluded || !view_is_visible(view))
+				continue;
+			if (output_box && wlr_box_intersection(&intersection,
+					output_box, &view->index_box)) {
+				view->frames_presented++;
+				view->present_pending = false;
+				wl_list_remove(&view->present_link);
+			}
+		}
+	}
+
+	output_send_frame_done(output, &now);
+	span_end(output->server, "output_render", span);
+}
+
+static int output_render_timer(void *data) {
+	output_render(data);
+	return 0;
+}
+
+/* Returns how long to wait before rendering so that it finishes just before
+ * the next vblank, or 0 to render right away. */
+static int output_frame_delay(struct tinywl_output *output) {
+	struct frame_schedule *schedule = &output->schedule;
+	if (CONFIG.max_render_time_ms == 0 || schedule->refresh_ns <= 0 ||
+			schedule->last_present.tv_sec == 0)
+		return 0;
+
+	int64_t render_ns = CONFIG.max_render_time_ms > 0 ?
+		(int64_t)CONFIG.max_render_time_ms * 1000000 :
+		schedule->render_estimate_ns + RENDER_SAFETY_MARGIN_NS;
+	struct timespec now, vblank = schedule->last_present;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespec_add_ns(&vblank, schedule->refresh_ns);
+
+	// Render right away if it is too late to wait, or the vblank is stale
+	int64_t delay_ns = timespec_diff_ns(&now, &vblank) - render_ns;
+	if (delay_ns < 1000000)
+		return 0;
+
+	schedule->deadline = vblank;
+	schedule->has_deadline = true;
+	return delay_ns / 1000000;
+}
+
 static void output_frame(struct wl_listener *listener, void *data) {
 	/* This function is called every time an output is ready to display a frame,
 	 * generally at the output's refresh rate (e.g. 60Hz). */
 	struct tinywl_output *output = wl_container_of(listener, output, frame);
-	struct wlr_scene *scene = output->server->scene;
+	struct frame_schedule *schedule = &output->schedule;
+	uint64_t span = span_begin(output->server);
 
-	struct wlr_scene_output *scene_output = wlr_scene_get_scene_output(
-		scene, output->wlr_output);
+	schedule->delay_ms = output_frame_delay(output);
+	if (schedule->delay_ms > 0) {
+		schedule->delayed_frames++;
+		wl_event_source_timer_update(schedule->timer, schedule->delay_ms);
+	} else {
+		output_render(output);
+	}
+	span_end(output->server, "output_frame", span);
+}
 
-	/* Render the scene if needed and commit the output */
-	wlr_scene_output_commit(scene_output);
+static void output_present(struct wl_listener *listener, void *data) {
+	struct tinywl_output *output = wl_container_of(listener, output, present);
+	struct wlr_output_event_present *event = data;
+	struct frame_schedule *schedule = &output->schedule;
+
+	if (event->when)
+		schedule->last_present = *event->when;
+	if (event->refresh > 0) {
+		schedule->refresh_ns = event->refresh;
+	} else if (output->wlr_output->refresh > 0) {
+		// The mode's refresh rate is in mHz
+		schedule->refresh_ns = 1000000000000LL / output->wlr_output->refresh;
+	}
+}
 
-	struct timespec now;
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	wlr_scene_output_send_frame_done(scene_output, &now);
+static void output_destroy(struct wl_listener *listener, void *data) {
+	/* The output was unplugged, a delayed frame must not fire on it anymore
+	 * and its fullscreen view goes back to where it was. */
+	struct tinywl_output *output = wl_container_of(listener, output, destroy);
+	wl_event_source_remove(output->schedule.timer);
+	wl_list_remove(&output->frame.link);
+	wl_list_remove(&output->present.link);
+	wl_list_remove(&output->commit.link);
+	wl_list_remove(&output->destroy.link);
+	wl_list_remove(&output->link);
+	if (output->fullscreen_view)
+		view_leave_fullscreen(output->fullscreen_view, true);
+	wlr_scene_node_destroy(&output->background->node);
+	free(output);
+}
+
+static struct wlr_scene_tree *generate_menu(struct tinywl_server *server){
+	const int margin = 5;
+	char *menu_items[] = {"Maximize Toggle", "Close"};
+	int menu_size = sizeof menu_items / sizeof *menu_items;
+
+	struct wlr_scene_tree *menu = wlr_scene_tree_create(&server->scene->node);
+	// The labels are sharp on the densest output the menu can open on
+	float scale = 1.0f;
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		if (output->wlr_output->scale > scale)
+			scale = output->wlr_output->scale;
+	}
+	int width, height, largest_width = 0;
+	for (int i = 0; i < menu_size; i++) {
+		get_text_size(&server->text_engine, menu_items[i], &width, &height);
+		if (width > largest_width)
+			largest_width = width;
+	}
+
+	for (int i = 0; i < menu_size; i++) {
+		struct wlr_scene_rect *container = wlr_scene_rect_create(
+			&menu->node, largest_width + margin*2, height + margin*2,
+			CONFIG.inactive_window_rgba);
+		/* We added an index field to node_init to use to determine which menu item
+		   we click later. One could skip doing this and loop through and compare the node
+		   with the list of menu item nodes instead if so desired. */
+		node_init(server, &container->node, MENU, NULL, NULL, i);
+		wlr_scene_node_set_position(&container->node, 0, (height + margin*2) * i);
+		struct text_buffer *buf = create_text_buffer(&server->text_engine,
+			menu_items[i], largest_width, height, NULL, scale);
+		struct wlr_scene_buffer *bb = wlr_scene_buffer_create(&container->node, &buf->base);
+		wlr_buffer_drop(&buf->base);
+		wlr_scene_buffer_set_dest_size(bb, largest_width, height);
+		node_init(server, &bb->node, MENU, container, NULL, i);
+		wlr_scene_node_set_position(&bb->node, margin, margin);
+	}
+
+	wlr_scene_node_set_enabled(&menu->node, false);
+	server->view_menu_scale = scale;
+	server->opened_menu_view = NULL;
+	server->selected_menu_item = NULL;
+	return menu;
+}
+
+/* Only clearly dense outputs get a scale of 2, fractional scales are left for
+ * CONFIG.output_scale. Outputs that don't know their size, like the headless
+ * and nested ones, stay at 1, and so do TVs and projectors whose EDID has the
+ * aspect ratio where the physical size should be. */
+static float output_auto_scale(struct wlr_output *wlr_output) {
+	static const int aspect_ratios[][2] = {
+		{ 16, 9 }, { 16, 10 }, { 160, 90 }, { 160, 100 },
+		{ 1600, 900 }, { 1600, 1000 },
+	};
+	int phys_width = wlr_output->phys_width;
+	int phys_height = wlr_output->phys_height;
+	if (phys_width <= 0 || phys_height <= 0 || wlr_output->width <= 0)
+		return 1.0f;
+	for (size_t i = 0; i < sizeof(aspect_ratios) / sizeof(*aspect_ratios); i++) {
+		if (phys_width == aspect_ratios[i][0] &&
+				phys_height == aspect_ratios[i][1]) {
+			return 1.0f;
+		}
+	}
+	double dpi = wlr_output->width * 25.4 / phys_width;
+	return dpi >= 192 ? 2.0f : 1.0f;
 }
 
 static void server_new_output(struct wl_listener *listener, void *data) {
@@ -1115,6 +3645,26 @@ static void server_new_output(struct wl_listener *listener, void *data) {
 			return;
 		}
 	}
+	/* The scene lays everything out in layout pixels, the decorations follow
+	 * the scale like the surfaces do. Fractional scales are fine, clients are
+	 * told the next integer and the compositor's own text is rendered at the
+	 * exact scale. */
+	float scale = CONFIG.output_scale > 0 ?
+		CONFIG.output_scale : output_auto_scale(wlr_output);
+	if (scale != wlr_output->scale) {
+		wlr_output_set_scale(wlr_output, scale);
+		if (!wlr_output_commit(wlr_output)) {
+			return;
+		}
+	}
+	wlr_xcursor_manager_load(server->cursor_mgr, wlr_output->scale);
+	/* Modeless outputs such as the headless ones may still be disabled */
+	if (!wlr_output->enabled) {
+		wlr_output_enable(wlr_output, true);
+		if (!wlr_output_commit(wlr_output)) {
+			return;
+		}
+	}
 
 	/* Allocates and configures our state for this output */
 	struct tinywl_output *output =
@@ -1124,6 +3674,14 @@ static void server_new_output(struct wl_listener *listener, void *data) {
 	/* Sets up a listener for the frame notify event. */
 	output->frame.notify = output_frame;
 	wl_signal_add(&wlr_output->events.frame, &output->frame);
+	output->present.notify = output_present;
+	wl_signal_add(&wlr_output->events.present, &output->present);
+	output->commit.notify = output_commit;
+	wl_signal_add(&wlr_output->events.commit, &output->commit);
+	output->destroy.notify = output_destroy;
+	wl_signal_add(&wlr_output->events.destroy, &output->destroy);
+	output->schedule.timer = wl_event_loop_add_timer(
+		wl_display_get_event_loop(server->wl_display), output_render_timer, output);
 	wl_list_insert(&server->outputs, &output->link);
 
 	output->background = wlr_scene_rect_create(
@@ -1141,6 +3699,25 @@ static void server_new_output(struct wl_listener *listener, void *data) {
 	 * output (such as DPI, scale factor, manufacturer, etc).
 	 */
 	wlr_output_layout_add_auto(server->output_layout, wlr_output);
+
+	// Titles of views on the new output may need a higher scale now
+	struct tinywl_view *view;
+	wl_list_for_each(view, &server->views, link) {
+		if (view->title.scale != 0.0f &&
+				view->title.scale != view_title_scale(view)) {
+			view_schedule_decorations(view);
+		}
+	}
+
+	// The menu labels were rendered for the outputs there were back then
+	if (server->view_menu && wlr_output->scale > server->view_menu_scale) {
+		wlr_scene_node_destroy(&server->view_menu->node);
+		server->view_menu = generate_menu(server);
+	}
+
+	// The new output has no cursor image yet, make sure the next one is set
+	cursor_forget_surface(server);
+	server->cursor_image = NULL;
 }
 
 static void xdg_toplevel_map(struct wl_listener *listener, void *data) {
@@ -1150,8 +3727,19 @@ static void xdg_toplevel_map(struct wl_listener *listener, void *data) {
 	position_view_centered(view);
 
 	wl_list_insert(&view->server->views, &view->link);
+	wlr_addon_init(&view->surface_addon, &view->xdg_surface->surface->addons,
+		view->server, &view_surface_addon_impl);
+	struct tinywl_view *parent = view_parent(view);
+	if (parent)
+		parent->child_count++;
+	view_index_update(view);
+	update_fullscreen_visibility(view->server);
 
 	focus_view(view, view->xdg_surface->surface);
+
+	struct wlr_xdg_toplevel *toplevel = view->xdg_surface->toplevel;
+	if (toplevel->requested.fullscreen)
+		view_enter_fullscreen(view, toplevel->requested.fullscreen_output);
 }
 
 static void xdg_toplevel_unmap(struct wl_listener *listener, void *data) {
@@ -1159,12 +3747,46 @@ static void xdg_toplevel_unmap(struct wl_listener *listener, void *data) {
 	struct tinywl_view *view = wl_container_of(listener, view, unmap);
 
 	wl_list_remove(&view->link);
+	if (view->indexed)
+		spatial_index_remove(&view->server->view_index, view);
+	struct tinywl_view *parent = view_parent(view);
+	if (parent)
+		parent->child_count--;
+	wlr_addon_finish(&view->surface_addon);
+
+	if (view->present_pending) {
+		view->present_pending = false;
+		wl_list_remove(&view->present_link);
+	}
+	if (view->decoration_dirty) {
+		view->decoration_dirty = false;
+		wl_list_remove(&view->decoration_link);
+	}
+	// The title nodes go with the scene node below
+	view_title_job_cancel(view);
+	view->server->visibility_dirty = true;
+	view_leave_fullscreen(view, false);
+
+	// Forget about any resize in flight, there is nothing left to move
+	view_resize_cancel(view);
 
 	// Destroy commit listener and node for decorations
 	wl_list_remove(&view->commit.link);
 	wlr_scene_node_destroy(view->scene_node);
 }
 
+static void view_release(struct tinywl_view *view) {
+	/* Everything the view owns goes back to the server's pools here. Nodes
+	 * still around belong to a view that was never mapped, so its scene tree
+	 * with the decorations is destroyed along with them. */
+	if (!wl_list_empty(&view->owned_nodes))
+		wlr_scene_node_destroy(view->scene_node);
+	assert(wl_list_empty(&view->owned_nodes));
+	view_title_job_cancel(view);
+	free(view->title.text);
+	slab_free(&view->server->view_pool, view);
+}
+
 static void xdg_toplevel_destroy(struct wl_listener *listener, void *data) {
 	/* Called when the surface is destroyed and should never be shown again. */
 	struct tinywl_view *view = wl_container_of(listener, view, destroy);
@@ -1175,39 +3797,55 @@ static void xdg_toplevel_destroy(struct wl_listener *listener, void *data) {
 	wl_list_remove(&view->request_move.link);
 	wl_list_remove(&view->request_resize.link);
 	wl_list_remove(&view->request_maximize.link);
+	wl_list_remove(&view->request_fullscreen.link);
 	wl_list_remove(&view->set_title.link);
+	wl_event_source_remove(view->resize.timeout);
+	// Views that never mapped aren't unmapped either
+	if (view->decoration_dirty)
+		wl_list_remove(&view->decoration_link);
 
-	free(view);
+	view_release(view);
 }
 
 static void xdg_toplevel_commit(struct wl_listener *listener, void *data) {
 	struct tinywl_view *view = wl_container_of(listener, view, commit);
+	uint64_t span = span_begin(view->server);
+	uint64_t profile = profile_begin(view->server);
 
-	int pending_width = view->xdg_surface->pending.geometry.width;
-	int pending_height = view->xdg_surface->pending.geometry.height;
-
-	// Only render a new title if the width of the view is different than title
-	if (pending_width - CONFIG.deco_button_size < view->title.current_width ||
-			(view->title.current_width != view->title.original_width &&
-			view->title.current_width != pending_width - CONFIG.border_size - CONFIG.deco_button_size)){
-		view_title_update(view, view->xdg_surface->toplevel->title);
+	view->commits++;
+	if (view->xdg_surface->surface->current.committed & WLR_SURFACE_STATE_BUFFER) {
+		if (view->present_pending) {
+			view->frames_discarded++;
+		} else {
+			view->present_pending = true;
+			wl_list_insert(&view->server->present_pending, &view->present_link);
+		}
 	}
 
-    // This needs to be done here otherwise the border/titlebar move faster/slower
-    // than the surface when the size is changed thus causing a lag effect.
-    if (view->border && (pending_width != view->border->width ||
-            pending_height != view->border->height - TITLEBAR_HEIGHT - CONFIG.border_size)){
-        wlr_scene_rect_set_size(view->border, pending_width + (CONFIG.border_size*2),
-                pending_height + TITLEBAR_HEIGHT + (CONFIG.border_size*2));
-		wlr_scene_rect_set_size(view->titlebar, pending_width,
-                TITLEBAR_HEIGHT);
-    }
-
-	if (view->close_button){
-		wlr_scene_node_set_position(&view->close_button->node,
-			view->xdg_surface->pending.geometry.width - view->close_button->width,
-			TITLEBAR_HEIGHT/2 - view->close_button->height/2);
+	// Serials wrap around, compare them as a signed distance
+	struct resize_transaction *resize = &view->resize;
+	uint32_t configure_serial = view->xdg_surface->current.configure_serial;
+	if (resize->late_serial &&
+			(int32_t)(configure_serial - resize->late_serial) >= 0) {
+		resize->late_serial = 0;
+		view_place_resized(view, &resize->late_box, resize->late_edges);
+	}
+	if (resize->serial && (int32_t)(configure_serial - resize->serial) >= 0)
+		view_apply_resize(view);
+
+	struct wlr_surface *surface = view->xdg_surface->surface;
+	struct decoration_state state = {
+		.geometry = view->xdg_surface->current.geometry,
+		.surface_width = surface->current.width,
+		.surface_height = surface->current.height,
+	};
+	wlr_surface_get_extends(surface, &state.extents);
+	if (memcmp(&state, &view->decoration_state, sizeof(state)) != 0) {
+		view->decoration_state = state;
+		view_queue_decorations(view);
 	}
+	profile_end(view->server, &view->server->profile_commit, profile);
+	span_end(view->server, "xdg_toplevel_commit", span);
 }
 
 /* This function is from labwc that calulates the view/window
@@ -1237,6 +3875,10 @@ static void begin_interactive(struct tinywl_view *view,
 		/* Deny move/resize requests from unfocused clients. */
 		return;
 	}
+	if (view->fullscreen_output) {
+		/* Fullscreen views stay put until they leave fullscreen. */
+		return;
+	}
 	server->grabbed_view = view;
 	server->cursor_mode = mode;
 
@@ -1302,12 +3944,32 @@ static void xdg_toplevel_request_maximize(struct wl_listener *listener, void *da
     toggle_maximize(view);
 }
 
+static void xdg_toplevel_request_fullscreen(struct wl_listener *listener, void *data) {
+	struct wlr_xdg_toplevel_set_fullscreen_event *event = data;
+	struct tinywl_view *view = wl_container_of(listener, view, request_fullscreen);
+	// Requests made before the first commit are applied when mapping
+	if (!view->xdg_surface->mapped)
+		return;
+	if (event->fullscreen)
+		view_enter_fullscreen(view, event->output);
+	else
+		view_leave_fullscreen(view, true);
+}
+
+static void xdg_popup_destroy(struct wl_listener *listener, void *data) {
+	struct tinywl_popup *popup = wl_container_of(listener, popup, destroy);
+	popup->server->popup_count--;
+	wl_list_remove(&popup->destroy.link);
+	free(popup);
+}
+
 static void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 	/* This event is raised when wlr_xdg_shell receives a new xdg surface from a
 	 * client, either a toplevel (application window) or popup. */
 	struct tinywl_server *server =
 		wl_container_of(listener, server, new_xdg_surface);
 	struct wlr_xdg_surface *xdg_surface = data;
+	uint64_t span = span_begin(server);
 
 	/* We must add xdg popups to the scene graph so they get rendered. The
 	 * wlroots scene graph provides a helper for this, but to use it we must
@@ -1320,15 +3982,25 @@ static void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 		struct wlr_scene_node *parent_node = parent->data;
 		xdg_surface->data = wlr_scene_xdg_surface_create(
 			parent_node, xdg_surface);
+
+		/* Hit-testing falls back to the scene graph while popups exist */
+		struct tinywl_popup *popup = calloc(1, sizeof(struct tinywl_popup));
+		popup->server = server;
+		popup->destroy.notify = xdg_popup_destroy;
+		wl_signal_add(&xdg_surface->events.destroy, &popup->destroy);
+		server->popup_count++;
+		span_end(server, "server_new_xdg_surface", span);
 		return;
 	}
 	assert(xdg_surface->role == WLR_XDG_SURFACE_ROLE_TOPLEVEL);
 
 	/* Allocate a tinywl_view for this surface */
-	struct tinywl_view *view =
-		calloc(1, sizeof(struct tinywl_view));
+	struct tinywl_view *view = slab_alloc(&server->view_pool);
 	view->server = server;
+	wl_list_init(&view->owned_nodes);
 	view->xdg_surface = xdg_surface;
+	view->resize.timeout = wl_event_loop_add_timer(
+		wl_display_get_event_loop(server->wl_display), view_resize_timeout, view);
 	/* If the new surface has a parent create it as part of the parent. Doing
 	 * this will ensure that a dialog will be seen when it's parent is focused.*/
     if (xdg_surface->toplevel->parent != 0) {
@@ -1339,16 +4011,16 @@ static void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 		// Create the border
 		view->border = wlr_scene_rect_create(
 			view->scene_node, 0, 0, CONFIG.inactive_window_rgba);
-		view->border->node.data = node_init(BORDER, NULL, view, 0);
+		node_init(server, &view->border->node, BORDER, NULL, view, 0);
 		// Create the titlebar and title text
 		view->titlebar = wlr_scene_rect_create(
 			&view->border->node, 0, 0, CONFIG.inactive_window_rgba);
-		view->titlebar->node.data = node_init(TITLEBAR, NULL, view, 0);
+		node_init(server, &view->titlebar->node, TITLEBAR, NULL, view, 0);
 		view_title_update(view, view->xdg_surface->toplevel->title);
 		// Create the close button
 		view->close_button = wlr_scene_rect_create(
 			&view->titlebar->node, 0, 0, (float [4]){0.8f, 0.22f, 0.0f, 1.0f});
-		view->close_button->node.data = node_init(CLOSE_BUTTON, NULL, view, 0);
+		node_init(server, &view->close_button->node, CLOSE_BUTTON, NULL, view, 0);
         wlr_scene_xdg_surface_create(view->scene_node, view->xdg_surface);
         // Set the decoration position. The size is handled by the commit handler
         wlr_scene_node_set_position(&view->border->node, -CONFIG.border_size,
@@ -1380,66 +4052,591 @@ static void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 	wl_signal_add(&toplevel->events.request_resize, &view->request_resize);
 	view->request_maximize.notify = xdg_toplevel_request_maximize;
 	wl_signal_add(&toplevel->events.request_maximize, &view->request_maximize);
+	view->request_fullscreen.notify = xdg_toplevel_request_fullscreen;
+	wl_signal_add(&toplevel->events.request_fullscreen, &view->request_fullscreen);
 	view->set_title.notify = xdg_toplevel_set_title;
 	wl_signal_add(&toplevel->events.set_title, &view->set_title);
+	span_end(server, "server_new_xdg_surface", span);
 }
 
-static struct wlr_scene_tree *generate_menu(struct tinywl_server *server){
-	const int margin = 5;
-	char *menu_items[] = {"Maximize Toggle", "Close"};
-	int menu_size = sizeof menu_items / sizeof *menu_items;
+static long current_rss_kb(void) {
+	long pages = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm) {
+		if (fscanf(statm, "%*s %ld", &pages) != 1)
+			pages = 0;
+		fclose(statm);
+	}
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
 
-	struct wlr_scene_tree *menu = wlr_scene_tree_create(&server->scene->node);
-	int width, height, largest_width = 0;
-	for (int i = 0; i < menu_size; i++) {
-		get_text_size(menu_items[i], CONFIG.font_description, &width, &height);
-		if (width > largest_width)
-			largest_width = width;
+static int sample_rss(void *data) {
+	struct rss_samples *samples = data;
+	long rss = current_rss_kb();
+	if (!samples->count++)
+		samples->first_kb = rss;
+	samples->last_kb = rss;
+	if (rss > samples->max_kb)
+		samples->max_kb = rss;
+	wl_event_source_timer_update(samples->timer, 1000);
+	return 0;
+}
+
+static void print_profile_counter(const char *name,
+		struct profile_counter *counter, size_t events) {
+	if (!counter->calls)
+		return;
+	printf("%s: %lu calls, mean %.2f us, max %.2f us, %.2f us per event\n",
+		name, (unsigned long)counter->calls,
+		counter->total_ns / 1e3 / counter->calls, counter->max_ns / 1e3,
+		events ? counter->total_ns / 1e3 / events : 0.0);
+}
+
+static void print_bench_report(struct tinywl_server *server) {
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		struct frame_stats *stats = &output->frame_stats;
+		if (!stats->frames)
+			continue;
+		printf("output %s: %lu frames, output_frame mean %.3f ms, "
+			"p50 %.1f ms, p99 %.1f ms, max %.3f ms\n",
+			output->wlr_output->name, (unsigned long)stats->frames,
+			stats->total_ns / 1e6 / stats->frames,
+			frame_stats_percentile_ms(stats, 50),
+			frame_stats_percentile_ms(stats, 99),
+			stats->max_ns / 1e6);
+		printf("output %s: %lu frames delayed, last delay %d ms, "
+			"%lu missed deadlines\n", output->wlr_output->name,
+			(unsigned long)output->schedule.delayed_frames,
+			output->schedule.delay_ms,
+			(unsigned long)output->schedule.missed_deadlines);
+
+		uint64_t fullscreen_frames = 0;
+		for (int i = 0; i < SCANOUT_STATUS_COUNT; i++)
+			fullscreen_frames += output->scanout[i];
+		if (fullscreen_frames) {
+			printf("output %s: %lu fullscreen frames", output->wlr_output->name,
+				(unsigned long)fullscreen_frames);
+			for (int i = 0; i < SCANOUT_STATUS_COUNT; i++) {
+				if (output->scanout[i]) {
+					printf(", %lu %s", (unsigned long)output->scanout[i],
+						scanout_status_names[i]);
+				}
+			}
+			printf("\n");
+		}
 	}
 
-	for (int i = 0; i < menu_size; i++) {
-		struct wlr_scene_rect *container = wlr_scene_rect_create(
-			&menu->node, largest_width + margin*2, height + margin*2,
-			CONFIG.inactive_window_rgba);
-		/* We added an index field to node_init to use to determine which menu item
-		   we click later. One could skip doing this and loop through and compare the node
-		   with the list of menu item nodes instead if so desired. */
-		container->node.data = node_init(MENU, NULL, NULL, i);
-		wlr_scene_node_set_position(&container->node, 0, (height + margin*2) * i);
-		struct text_buffer *buf = create_text_buffer(menu_items[i], largest_width, height);
-		struct wlr_scene_buffer *text_scene_buffer = malloc(sizeof(struct wlr_scene_buffer));
-		struct wlr_scene_buffer *bb = wlr_scene_buffer_create(&container->node, &buf->base);
-		bb->node.data = node_init(MENU, container, NULL, i);
-		wlr_scene_node_set_position(&bb->node, margin, margin);
+	uint64_t presented = 0, discarded = 0, throttled = 0;
+	struct tinywl_view *view;
+	wl_list_for_each(view, &server->views, link) {
+		presented += view->frames_presented;
+		discarded += view->frames_discarded;
+		throttled += view->frames_throttled;
+	}
+	printf("mapped views: %lu frames presented, %lu discarded, "
+		"%lu frame callbacks throttled\n", (unsigned long)presented,
+		(unsigned long)discarded, (unsigned long)throttled);
+	/* Both are per commit, the handler cost should stay flat whatever rate
+	 * the clients commit at and only resizes reach the decorations. */
+	print_profile_counter("xdg_toplevel_commit", &server->profile_commit,
+		server->profile_commit.calls);
+	print_profile_counter("decoration updates", &server->profile_decorations,
+		server->profile_commit.calls);
+	printf("text backend " TEXT_BACKEND_NAME ": engine init %.2f ms\n",
+		server->text_engine_init_ns / 1e6);
+	print_profile_counter("text measure", &server->profile_text_measure,
+		server->profile_text_measure.calls);
+	print_profile_counter("text render", &server->profile_text_render,
+		server->profile_text_render.calls);
+	struct title_workers *workers = &server->title_workers;
+	pthread_mutex_lock(&workers->lock);
+	print_profile_counter("text render on workers", &workers->profile_render,
+		workers->profile_render.calls);
+	pthread_mutex_unlock(&workers->lock);
+	if (workers->submitted) {
+		printf("title workers: %d threads, %lu jobs, %lu coalesced while "
+			"queued, %lu superseded while rendering\n", workers->count,
+			(unsigned long)workers->submitted, (unsigned long)workers->coalesced,
+			(unsigned long)workers->superseded);
 	}
 
-	wlr_scene_node_set_enabled(&menu->node, false);
-	server->opened_menu_view = NULL;
-	server->selected_menu_item = NULL;
-	return menu;
+	print_slab_pool(&server->view_pool);
+	print_slab_pool(&server->node_pool);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("compositor RSS %ld KiB, peak %ld KiB\n",
+		current_rss_kb(), usage.ru_maxrss);
+	struct rss_samples *samples = &server->rss_samples;
+	if (samples->count) {
+		printf("compositor RSS over %d samples: first %ld KiB, last %ld KiB, "
+			"max %ld KiB\n", samples->count, samples->first_kb,
+			samples->last_kb, samples->max_kb);
+	}
+}
+
+static size_t scene_node_count(struct wlr_scene_node *node) {
+	size_t count = 1;
+	struct wlr_scene_node *child;
+	wl_list_for_each(child, &node->state.children, state.link)
+		count += scene_node_count(child);
+	return count;
+}
+
+/* Writes a string as a single protocol word, app ids are client controlled */
+static void stats_put_word(FILE *f, const char *word) {
+	if (!word || !*word) {
+		fputc('-', f);
+		return;
+	}
+	for (; *word; word++)
+		fputc(*word == ' ' || *word == '\n' || *word == '\t' ? '_' : *word, f);
+}
+
+static void stats_put_pool(FILE *f, struct slab_pool *pool) {
+	fprintf(f, "pool ");
+	stats_put_word(f, pool->name);
+	fprintf(f, " in_use=%zu peak=%zu slabs=%zu allocs=%lu frees=%lu\n",
+		pool->in_use, pool->peak, pool->slab_count,
+		(unsigned long)pool->allocs, (unsigned long)pool->frees);
+}
+
+struct stats_client {
+	struct wl_client *client;
+	pid_t pid;
+	int views;
+	uint64_t commits, buffer_pixels;
+};
+
+static void stats_write_report(struct tinywl_server *server, FILE *f) {
+	fprintf(f, "tinywl-stats 1\n");
+
+	struct tinywl_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		struct frame_stats *stats = &output->frame_stats;
+		const char *name = output->wlr_output->name;
+		fprintf(f, "output %s frames=%lu mean_us=%lu p50_ms=%.1f p99_ms=%.1f "
+			"max_us=%lu delayed=%lu missed=%lu\n", name,
+			(unsigned long)stats->frames,
+			stats->frames ? (unsigned long)(stats->total_ns / 1000 / stats->frames) : 0,
+			frame_stats_percentile_ms(stats, 50),
+			frame_stats_percentile_ms(stats, 99),
+			(unsigned long)(stats->max_ns / 1000),
+			(unsigned long)output->schedule.delayed_frames,
+			(unsigned long)output->schedule.missed_deadlines);
+		// Only the non-empty buckets, as lower bound in us:count
+		fprintf(f, "histogram %s", name);
+		for (int i = 0; i < FRAME_HISTOGRAM_BUCKETS; i++) {
+			if (stats->histogram[i]) {
+				fprintf(f, " %d:%u", i * FRAME_HISTOGRAM_BUCKET_NS / 1000,
+					stats->histogram[i]);
+			}
+		}
+		fprintf(f, "\n");
+		fprintf(f, "scanout %s", name);
+		for (int i = 0; i < SCANOUT_STATUS_COUNT; i++) {
+			fprintf(f, " ");
+			stats_put_word(f, scanout_status_names[i]);
+			fprintf(f, "=%lu", (unsigned long)output->scanout[i]);
+		}
+		fprintf(f, "\n");
+	}
+
+	struct wl_array clients;
+	wl_array_init(&clients);
+	int views = 0;
+	struct tinywl_view *view;
+	wl_list_for_each(view, &server->views, link) {
+		struct wlr_surface *surface = view->xdg_surface->surface;
+		struct wl_client *client = wl_resource_get_client(surface->resource);
+		pid_t pid = 0;
+		wl_client_get_credentials(client, &pid, NULL, NULL);
+		fprintf(f, "view pid=%d app_id=", (int)pid);
+		stats_put_word(f, view->xdg_surface->toplevel->app_id);
+		fprintf(f, " commits=%lu buffer=%dx%d presented=%lu discarded=%lu "
+			"throttled=%lu occluded=%d\n", (unsigned long)view->commits,
+			surface->current.buffer_width, surface->current.buffer_height,
+			(unsigned long)view->frames_presented,
+			(unsigned long)view->frames_discarded,
+			(unsigned long)view->frames_throttled, view->occluded);
+		views++;
+
+		struct stats_client *entry, *found = NULL;
+		wl_array_for_each(entry, &clients) {
+			if (entry->client == client) {
+				found = entry;
+				break;
+			}
+		}
+		if (!found) {
+			found = wl_array_add(&clients, sizeof(*found));
+			if (!found)
+				continue;
+			*found = (struct stats_client){ .client = client, .pid = pid };
+		}
+		found->views++;
+		found->commits += view->commits;
+		found->buffer_pixels += (uint64_t)surface->current.buffer_width *
+			surface->current.buffer_height;
+	}
+	struct stats_client *entry;
+	wl_array_for_each(entry, &clients) {
+		fprintf(f, "client pid=%d views=%d commits=%lu buffer_pixels=%lu\n",
+			(int)entry->pid, entry->views, (unsigned long)entry->commits,
+			(unsigned long)entry->buffer_pixels);
+	}
+	wl_array_release(&clients);
+
+	fprintf(f, "views %d\n", views);
+	fprintf(f, "scene_nodes %zu\n", scene_node_count(&server->scene->node));
+	fprintf(f, "hit_tests total=%lu scene_walks=%lu\n",
+		(unsigned long)server->hit_tests,
+		(unsigned long)server->hit_test_scene_walks);
+	stats_put_pool(f, &server->view_pool);
+	stats_put_pool(f, &server->node_pool);
+	fprintf(f, "title_cache entries=%d size=%d\n",
+		server->title_cache_length, CONFIG.title_cache_size);
+	struct title_workers *workers = &server->title_workers;
+	fprintf(f, "title_workers threads=%d jobs=%lu coalesced=%lu "
+		"superseded=%lu\n", workers->count, (unsigned long)workers->submitted,
+		(unsigned long)workers->coalesced, (unsigned long)workers->superseded);
+	fprintf(f, "rss kb=%ld\n", current_rss_kb());
+	fprintf(f, "end\n");
+}
+
+static void stats_connection_close(struct stats_connection *conn) {
+	wl_list_remove(&conn->link);
+	wl_event_source_remove(conn->source);
+	close(conn->fd);
+	free(conn->data);
+	free(conn);
+}
+
+static int stats_connection_write(int fd, uint32_t mask, void *data) {
+	struct stats_connection *conn = data;
+	while (conn->written < conn->size) {
+		ssize_t n = send(fd, conn->data + conn->written,
+			conn->size - conn->written, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n <= 0)
+			break;
+		conn->written += n;
+	}
+	stats_connection_close(conn);
+	return 0;
+}
+
+static int stats_socket_accept(int fd, uint32_t mask, void *data) {
+	struct tinywl_server *server = data;
+	int client_fd = accept(fd, NULL, NULL);
+	if (client_fd < 0)
+		return 0;
+	if (fcntl(client_fd, F_SETFD, FD_CLOEXEC) < 0 ||
+			fcntl(client_fd, F_SETFL, O_NONBLOCK) < 0) {
+		close(client_fd);
+		return 0;
+	}
+
+	struct stats_connection *conn = calloc(1, sizeof(struct stats_connection));
+	FILE *f = conn ? open_memstream(&conn->data, &conn->size) : NULL;
+	if (!f) {
+		free(conn);
+		close(client_fd);
+		return 0;
+	}
+	stats_write_report(server, f);
+	fclose(f);
+
+	conn->fd = client_fd;
+	conn->source = wl_event_loop_add_fd(
+		wl_display_get_event_loop(server->wl_display), client_fd,
+		WL_EVENT_WRITABLE, stats_connection_write, conn);
+	wl_list_insert(&server->stats.connections, &conn->link);
+	return 0;
+}
+
+/* The stats socket is named after the Wayland socket, e.g. wayland-1.stats,
+ * so it is as unique as that one. Failing to create it isn't fatal. */
+static void stats_socket_init(struct tinywl_server *server,
+		const char *socket_name) {
+	struct stats_socket *stats = &server->stats;
+	stats->fd = -1;
+	wl_list_init(&stats->connections);
+
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (!runtime_dir || snprintf(addr.sun_path, sizeof(addr.sun_path),
+			"%s/%s.stats", runtime_dir, socket_name) >=
+			(int)sizeof(addr.sun_path)) {
+		wlr_log(WLR_ERROR, "No room for the stats socket path");
+		return;
+	}
+
+	// The Wayland socket lock is held, anything left at this path is stale
+	unlink(addr.sun_path);
+	stats->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (stats->fd < 0 ||
+			bind(stats->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(stats->fd, 8) < 0) {
+		wlr_log_errno(WLR_ERROR, "Failed to create stats socket %s",
+			addr.sun_path);
+		if (stats->fd >= 0)
+			close(stats->fd);
+		stats->fd = -1;
+		return;
+	}
+	stats->path = strdup(addr.sun_path);
+	stats->source = wl_event_loop_add_fd(
+		wl_display_get_event_loop(server->wl_display), stats->fd,
+		WL_EVENT_READABLE, stats_socket_accept, server);
+	setenv("TINYWL_STATS_SOCKET", stats->path, true);
+}
+
+static void stats_socket_finish(struct stats_socket *stats) {
+	struct stats_connection *conn, *tmp;
+	wl_list_for_each_safe(conn, tmp, &stats->connections, link) {
+		stats_connection_close(conn);
+	}
+	if (stats->fd < 0)
+		return;
+	wl_event_source_remove(stats->source);
+	close(stats->fd);
+	unlink(stats->path);
+	free(stats->path);
+}
+
+static bool trace_open_record(struct tinywl_server *server, const char *path) {
+	server->trace_record = fopen(path, "wb");
+	if (!server->trace_record ||
+			fwrite(TRACE_MAGIC, strlen(TRACE_MAGIC), 1, server->trace_record) != 1) {
+		wlr_log(WLR_ERROR, "Failed to open input trace %s for recording", path);
+		return false;
+	}
+	return true;
+}
+
+static bool trace_load_replay(struct tinywl_server *server, const char *path) {
+	struct input_replay *replay = &server->replay;
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	FILE *file = fopen(path, "rb");
+	if (!file || fread(magic, sizeof(magic), 1, file) != 1 ||
+			memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+		wlr_log(WLR_ERROR, "%s is not an input trace", path);
+		if (file)
+			fclose(file);
+		return false;
+	}
+
+	size_t capacity = 1024;
+	replay->events = malloc(capacity * sizeof(struct trace_event));
+	while (replay->events && fread(&replay->events[replay->count],
+			sizeof(struct trace_event), 1, file) == 1) {
+		if (++replay->count == capacity) {
+			capacity *= 2;
+			struct trace_event *events = realloc(replay->events,
+				capacity * sizeof(struct trace_event));
+			if (!events)
+				free(replay->events);
+			replay->events = events;
+		}
+	}
+	fclose(file);
+	if (!replay->events) {
+		wlr_log(WLR_ERROR, "Failed to allocate the input trace of %s", path);
+		replay->count = 0;
+		return false;
+	}
+	return true;
+}
+
+static void replay_event(struct tinywl_server *server, struct trace_event *trace) {
+	/* Events are emitted on the same signals the backend devices use so they
+	 * take exactly the same path through the handlers. */
+	switch (trace->type) {
+	case TRACE_MOTION:;
+		struct wlr_event_pointer_motion motion = {
+			.time_msec = trace->time_msec,
+			.delta_x = trace->motion.dx, .delta_y = trace->motion.dy,
+			.unaccel_dx = trace->motion.dx, .unaccel_dy = trace->motion.dy,
+		};
+		wl_signal_emit(&server->cursor->events.motion, &motion);
+		break;
+	case TRACE_MOTION_ABSOLUTE:;
+		struct wlr_event_pointer_motion_absolute motion_absolute = {
+			.time_msec = trace->time_msec,
+			.x = trace->motion_absolute.x, .y = trace->motion_absolute.y,
+		};
+		wl_signal_emit(&server->cursor->events.motion_absolute, &motion_absolute);
+		break;
+	case TRACE_BUTTON:;
+		struct wlr_event_pointer_button button = {
+			.time_msec = trace->time_msec,
+			.button = trace->button.button, .state = trace->button.state,
+		};
+		wl_signal_emit(&server->cursor->events.button, &button);
+		break;
+	case TRACE_AXIS:;
+		struct wlr_event_pointer_axis axis = {
+			.time_msec = trace->time_msec,
+			.source = trace->axis.source,
+			.orientation = trace->axis.orientation,
+			.delta = trace->axis.delta,
+			.delta_discrete = trace->axis.delta_discrete,
+		};
+		wl_signal_emit(&server->cursor->events.axis, &axis);
+		break;
+	case TRACE_FRAME:
+		wl_signal_emit(&server->cursor->events.frame, server->cursor);
+		break;
+	case TRACE_KEY:
+		if (wl_list_empty(&server->keyboards))
+			break;
+		struct tinywl_keyboard *keyboard =
+			wl_container_of(server->keyboards.next, keyboard, link);
+		struct wlr_event_keyboard_key key = {
+			.time_msec = trace->time_msec,
+			.keycode = trace->key.keycode,
+			.update_state = true,
+			.state = trace->key.state,
+		};
+		/* This updates the xkb state before emitting the key signal */
+		wlr_keyboard_notify_key(&keyboard->group->keyboard, &key);
+		break;
+	}
+}
+
+static void print_replay_report(struct tinywl_server *server) {
+	struct input_replay *replay = &server->replay;
+	size_t counts[TRACE_KEY + 1] = {0};
+	for (size_t i = 0; i < replay->count; i++) {
+		if (replay->events[i].type <= TRACE_KEY)
+			counts[replay->events[i].type]++;
+	}
+	printf("replayed %zu events: %zu motion, %zu absolute motion, %zu button, "
+		"%zu axis, %zu frame, %zu key\n", replay->count,
+		counts[TRACE_MOTION], counts[TRACE_MOTION_ABSOLUTE], counts[TRACE_BUTTON],
+		counts[TRACE_AXIS], counts[TRACE_FRAME], counts[TRACE_KEY]);
+	print_profile_counter("process_cursor_motion",
+		&server->profile_cursor_motion, replay->count);
+	print_profile_counter("desktop_view_at",
+		&server->profile_view_at, replay->count);
+	print_profile_counter("cursor image updates",
+		&server->profile_cursor_image, replay->count);
+	uint64_t requests = server->profile_cursor_image.calls +
+		server->cursor_image_skipped;
+	if (requests) {
+		printf("cursor image: %lu of %lu requests skipped as unchanged, "
+			"%.2f skipped per event\n", (unsigned long)server->cursor_image_skipped,
+			(unsigned long)requests, replay->count ?
+			(double)server->cursor_image_skipped / replay->count : 0.0);
+	}
+}
+
+static int replay_next_events(void *data) {
+	/* Replays every event sharing the next timestamp, then waits for as long as
+	 * the recorded session did before the one after. */
+	struct tinywl_server *server = data;
+	struct input_replay *replay = &server->replay;
+	if (replay->next < replay->count) {
+		uint32_t time = replay->events[replay->next].time_msec;
+		while (replay->next < replay->count &&
+				replay->events[replay->next].time_msec == time) {
+			replay_event(server, &replay->events[replay->next++]);
+		}
+		if (replay->next < replay->count) {
+			int32_t delay = replay->events[replay->next].time_msec - time;
+			wl_event_source_timer_update(replay->timer, delay > 0 ? delay : 1);
+			return 0;
+		}
+	}
+
+	print_replay_report(server);
+	wl_display_terminate(server->wl_display);
+	return 0;
+}
+
+static int handle_spans_dump(int signal_number, void *data) {
+	spans_dump(data);
+	return 0;
+}
+
+static int handle_bench_child_exit(int signal_number, void *data) {
+	/* In benchmark mode the startup command is the driver, stop with it.
+	 * Other children, like the ones spawn_command forks, are left alone. */
+	struct tinywl_server *server = data;
+	if (server->startup_pid > 0 &&
+			waitpid(server->startup_pid, NULL, WNOHANG) == server->startup_pid) {
+		wl_display_terminate(server->wl_display);
+	}
+	return 0;
 }
 
 int main(int argc, char *argv[]) {
-	wlr_log_init(WLR_DEBUG, NULL);
 	char *startup_cmd = NULL;
+	char *record_path = NULL;
+	char *replay_path = NULL;
+	char *keybindings_path = NULL;
+	char *spans_path = NULL;
+	bool bench = false;
 
 	int c;
-	while ((c = getopt(argc, argv, "s:h")) != -1) {
+	while ((c = getopt(argc, argv, "s:br:p:k:t:h")) != -1) {
 		switch (c) {
 		case 's':
 			startup_cmd = optarg;
 			break;
+		case 'b':
+			bench = true;
+			break;
+		case 'r':
+			record_path = optarg;
+			break;
+		case 'p':
+			replay_path = optarg;
+			break;
+		case 'k':
+			keybindings_path = optarg;
+			break;
+		case 't':
+			spans_path = optarg;
+			break;
 		default:
-			printf("Usage: %s [-s startup command]\n", argv[0]);
+			printf("Usage: %s [-s startup command] [-b] [-r record trace] "
+				"[-p replay trace] [-k keybindings] [-t spans trace]\n", argv[0]);
 			return 0;
 		}
 	}
 	if (optind < argc) {
-		printf("Usage: %s [-s startup command]\n", argv[0]);
+		printf("Usage: %s [-s startup command] [-b] [-r record trace] "
+			"[-p replay trace] [-k keybindings] [-t spans trace]\n", argv[0]);
 		return 0;
 	}
-
-	struct tinywl_server server;
+	/* Replaying a trace runs headless just like the benchmark does */
+	bool headless = bench || replay_path;
+	wlr_log_init(headless ? WLR_ERROR : WLR_DEBUG, NULL);
+
+	struct tinywl_server server = {0};
+	slab_pool_init(&server.view_pool, "view", sizeof(struct tinywl_view));
+	slab_pool_init(&server.node_pool, "node details",
+		sizeof(struct tinywl_node_details));
+	if (record_path && !trace_open_record(&server, record_path))
+		return 1;
+	if (replay_path && !trace_load_replay(&server, replay_path))
+		return 1;
+	server.profiling = replay_path != NULL || bench;
+	server.throttle_occluded = !bench;
+	if (spans_path) {
+		server.spans = calloc(1, sizeof(struct span_ring));
+		if (!server.spans) {
+			wlr_log(WLR_ERROR, "Failed to allocate the span ring");
+			return 1;
+		}
+		server.spans->path = spans_path;
+	}
 
 	/* The Wayland display is managed by libwayland. It handles accepting
 	 * clients from the Unix socket, manging Wayland globals, and so on. */
@@ -1447,14 +4644,25 @@ int main(int argc, char *argv[]) {
 	/* The backend is a wlroots feature which abstracts the underlying input and
 	 * output hardware. The autocreate option will choose the most suitable
 	 * backend based on the current environment, such as opening an X11 window
-	 * if an X11 server is running. */
-	server.backend = wlr_backend_autocreate(server.wl_display);
+	 * if an X11 server is running.
+	 *
+	 * The benchmark and replay modes always run headless with the pixman
+	 * renderer so that they can run on machines without a GPU or display. */
+	if (headless) {
+		server.backend = wlr_headless_backend_create(server.wl_display);
+	} else {
+		server.backend = wlr_backend_autocreate(server.wl_display);
+	}
 
 	/* Autocreates a renderer, either Pixman, GLES2 or Vulkan for us. The user
 	 * can also specify a renderer using the WLR_RENDERER env var.
 	 * The renderer is responsible for defining the various pixel formats it
 	 * supports for shared memory, this configures that for clients. */
-	server.renderer = wlr_renderer_autocreate(server.backend);
+	if (headless) {
+		server.renderer = wlr_pixman_renderer_create();
+	} else {
+		server.renderer = wlr_renderer_autocreate(server.backend);
+	}
 	wlr_renderer_init_wl_display(server.renderer, server.wl_display);
 
 	/* Autocreates an allocator for us.
@@ -1492,6 +4700,13 @@ int main(int argc, char *argv[]) {
 	server.scene = wlr_scene_create();
 	wlr_scene_attach_output_layout(server.scene, server.output_layout);
 
+	/* The presentation-time protocol tells clients when their content was
+	 * actually shown, the scene sends the feedback as it renders surfaces. */
+	wl_list_init(&server.present_pending);
+	wl_list_init(&server.decorations_dirty);
+	server.presentation = wlr_presentation_create(server.wl_display, server.backend);
+	wlr_scene_set_presentation(server.scene, server.presentation);
+
 	/* Use decoration protocols to negotiate server-side decorations */
 	wlr_server_decoration_manager_set_default_mode(
 			wlr_server_decoration_manager_create(server.wl_display),
@@ -1503,7 +4718,22 @@ int main(int argc, char *argv[]) {
 	 *
 	 * https://drewdevault.com/2018/07/29/Wayland-shells.html
 	 */
+	/* Set up the text engine once, the titlebar height only depends on the
+	 * font so it can be derived here instead of per title. */
+	struct timespec text_start, text_end;
+	clock_gettime(CLOCK_MONOTONIC, &text_start);
+	if (!text_engine_init(&server.text_engine, CONFIG.font_description)) {
+		wlr_backend_destroy(server.backend);
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &text_end);
+	server.text_engine_init_ns = timespec_diff_ns(&text_start, &text_end);
+	TITLEBAR_HEIGHT = server.text_engine.line_height + CONFIG.titlebar_padding * 2;
+
 	wl_list_init(&server.views);
+	wl_list_init(&server.title_cache);
+	server.title_cache_length = 0;
+	title_workers_init(&server);
 	server.xdg_shell = wlr_xdg_shell_create(server.wl_display);
 	server.new_xdg_surface.notify = server_new_xdg_surface;
 	wl_signal_add(&server.xdg_shell->events.new_surface,
@@ -1535,6 +4765,8 @@ int main(int argc, char *argv[]) {
 	 *
 	 * And more comments are sprinkled throughout the notify functions above.
 	 */
+	server.relative_pointer_manager =
+		wlr_relative_pointer_manager_v1_create(server.wl_display);
 	server.cursor_motion.notify = server_cursor_motion;
 	wl_signal_add(&server.cursor->events.motion, &server.cursor_motion);
 	server.cursor_motion_absolute.notify = server_cursor_motion_absolute;
@@ -1553,6 +4785,8 @@ int main(int argc, char *argv[]) {
 	 * pointer, touch, and drawing tablet device. We also rig up a listener to
 	 * let us know when new input devices are available on the backend.
 	 */
+	server.xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	keybindings_load(&server.keybindings, keybindings_path);
 	wl_list_init(&server.keyboards);
 	server.new_input.notify = server_new_input;
 	wl_signal_add(&server.backend->events.new_input, &server.new_input);
@@ -1571,6 +4805,33 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	stats_socket_init(&server, socket);
+
+	if (headless)
+		wlr_headless_add_output(server.backend, 1920, 1080);
+	if (server.spans) {
+		// kill -USR1 writes the spans recorded so far without stopping
+		wl_event_loop_add_signal(wl_display_get_event_loop(server.wl_display),
+			SIGUSR1, handle_spans_dump, server.spans);
+	}
+	if (bench) {
+		wl_event_loop_add_signal(wl_display_get_event_loop(server.wl_display),
+			SIGCHLD, handle_bench_child_exit, &server);
+		server.rss_samples.timer = wl_event_loop_add_timer(
+			wl_display_get_event_loop(server.wl_display),
+			sample_rss, &server.rss_samples);
+		wl_event_source_timer_update(server.rss_samples.timer, 1000);
+	}
+	if (replay_path) {
+		/* Replayed key events need a keyboard with a keymap to go through. The
+		 * first events are delayed a second to let the startup command map. */
+		wlr_headless_add_input_device(server.backend, WLR_INPUT_DEVICE_KEYBOARD);
+		server.replay.timer = wl_event_loop_add_timer(
+			wl_display_get_event_loop(server.wl_display),
+			replay_next_events, &server);
+		wl_event_source_timer_update(server.replay.timer, 1000);
+	}
+
 	/* Start the backend. This will enumerate outputs and inputs, become the DRM
 	 * master, etc */
 	if (!wlr_backend_start(server.backend)) {
@@ -1586,9 +4847,9 @@ int main(int argc, char *argv[]) {
 	 * startup command if requested. */
 	setenv("WAYLAND_DISPLAY", socket, true);
 	if (startup_cmd) {
-		if (fork() == 0) {
-			execl("/bin/sh", "/bin/sh", "-c", startup_cmd, (void *)NULL);
-		}
+		server.startup_pid = fork();
+		if (server.startup_pid == 0)
+			exec_command(startup_cmd);
 	}
 	/* Run the Wayland event loop. This does not return until you exit the
 	 * compositor. Starting the backend rigged up all of the necessary event
@@ -1599,7 +4860,24 @@ int main(int argc, char *argv[]) {
 	wl_display_run(server.wl_display);
 
 	/* Once wl_display_run returns, we shut down the server. */
+	if (bench)
+		print_bench_report(&server);
+	if (server.trace_record)
+		fclose(server.trace_record);
+	if (server.spans)
+		spans_dump(server.spans);
+	free(server.replay.events);
 	wl_display_destroy_clients(server.wl_display);
+	title_workers_finish(&server.title_workers);
+	stats_socket_finish(&server.stats);
+	title_cache_finish(&server);
+	spatial_index_finish(&server.view_index);
+	text_engine_finish(&server.text_engine);
 	wl_display_destroy(server.wl_display);
+	keyboard_groups_finish(&server);
+	keybindings_finish(&server.keybindings);
+	slab_pool_finish(&server.view_pool);
+	slab_pool_finish(&server.node_pool);
+	free(server.spans);
 	return 0;
 }